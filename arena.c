@@ -0,0 +1,84 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Bump allocator for records that all die at the same time.
+ *
+ * Allocations are carved from chunks in order and never freed one by one.
+ * A reset only rewinds to the first chunk, the chunks are kept and reused,
+ * so after the first cycles there are no allocator calls at all.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "helper.h"
+#include "arena.h"
+
+#define ARENA_ALIGN	16
+
+void arena_init(struct arena *a, size_t chunk_size)
+{
+	a->head = NULL;
+	a->cur = NULL;
+	a->used = 0;
+	a->chunk_size = chunk_size;
+	a->held = 0;
+}
+
+static struct arena_chunk *new_chunk(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	c = malloc(sizeof(*c) + a->chunk_size);
+	if (!c)
+		DIE_PERROR("malloc failed");
+	c->next = NULL;
+	c->size = a->chunk_size;
+	a->held += a->chunk_size;
+	return c;
+}
+
+/* not zeroed, the memory is valid until the next reset */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (size > a->chunk_size)
+		DIE("arena allocation of %zu bytes too large", size);
+
+	if (!a->cur) {
+		if (!a->head)
+			a->head = new_chunk(a);
+		a->cur = a->head;
+		a->used = 0;
+	}
+	if (a->used + size > a->cur->size) {
+		if (!a->cur->next)
+			a->cur->next = new_chunk(a);
+		a->cur = a->cur->next;
+		a->used = 0;
+	}
+	p = a->cur->data + a->used;
+	a->used += size;
+	return p;
+}
+
+/* drops all allocations at once */
+void arena_reset(struct arena *a)
+{
+	a->cur = a->head;
+	a->used = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = a->head; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	arena_init(a, a->chunk_size);
+}
@@ -0,0 +1,30 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for records that all die at the same time
+ */
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	char data[] __attribute__ ((aligned(16)));
+};
+
+struct arena {
+	struct arena_chunk *head;	/* chunks are kept over resets */
+	struct arena_chunk *cur;
+	size_t used;			/* bytes taken from the current chunk */
+	size_t chunk_size;
+	size_t held;			/* bytes of all chunks */
+};
+
+/* arena interface prototypes */
+void arena_init(struct arena *a, size_t chunk_size);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif
@@ -45,16 +45,14 @@ static inline void atomic_sub(int i, atomic_t *v)
 
 #else /* !ARM */
 
-/* for now these are just non-atomic fakes ... */
-
 static inline void atomic_add(int i, atomic_t *v)
 {
-	v->counter += i;
+	__atomic_fetch_add(&v->counter, i, __ATOMIC_SEQ_CST);
 }
 
 static inline void atomic_sub(int i, atomic_t *v)
 {
-	v->counter -= i;
+	__atomic_fetch_sub(&v->counter, i, __ATOMIC_SEQ_CST);
 }
 
 #endif /* ARM */
@@ -2,139 +2,250 @@
  * Copyright Penguin Boost, 2016
  * Author(s): Jan Glauber <jan.glauber@gmail.com>
  *
- * Simple linear bitmap relying on atomic bit set|clear|test
+ * Two-level lock-free bitmap for the pid space.
+ *
+ * The leaf words hold one bit per pid, every bit of a summary word marks a
+ * non-empty leaf word. Finding the next set bit skips empty leaf words with
+ * the summary, so iterating the set bits costs about the number of set bits
+ * and not the size of the map. The highest set bit is tracked as well and
+ * bounds the iteration.
+ *
+ * All updates are atomic read-modify-write operations on whole words, the
+ * compiler builtins map to lock prefixed instructions on x86 and to
+ * ldrex/strex loops on ARMv6+.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
 
 #include "helper.h"
+#include "bitmap.h"
 
-static char *map;
-static int nr_bits;
+#define BITS_PER_WORD		(8 * sizeof(unsigned long))
+#define WORDS(bits)		(((bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define BIT(nr)			(1UL << ((nr) % BITS_PER_WORD))
 
-extern FILE *logfile;
+static unsigned long *map;
+static unsigned long *summary;
+static int nr_bits;
+static int nr_words;
 
-/*
- * ARM has not atomic bitops so we need a lock...
- */
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* no set bit above, may be stale high after a clear but never too low */
+static int max_bit = -1;
 
-/*
- * TODO:
- * - map ptr for multiple maps
- */
+extern FILE *logfile;
 
-/*
- * TODO: check alignment
- */
 void bm_alloc(int bits)
 {
-	int bytes = bits / 8;
-
-	if (!bits || bits < 0 || bits % 8)
+	if (bits <= 0)
 		DIE("invalid bit count: %d", bits);
 
-	map = malloc(bytes);
-	if (!map)
+	nr_words = WORDS(bits);
+	map = calloc(nr_words, sizeof(unsigned long));
+	summary = calloc(WORDS(nr_words), sizeof(unsigned long));
+	if (!map || !summary)
 		DIE_PERROR("allocating bitmap failed");
-	memset(map, 0, bytes);
 
 	nr_bits = bits;
+	max_bit = -1;
 	DEBUG("alloc map @ %p  for %d bits\n", map, nr_bits);
 }
 
 void bm_destroy(void)
 {
 	free(map);
+	free(summary);
 }
 
 static void access_ok(int bit)
 {
-	if (bit > nr_bits)
+	if (bit < 0 || bit >= nr_bits)
 		DIE("bitmap overflow");
 }
 
+static inline unsigned long load_word(unsigned long *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void raise_max(int bit_nr)
+{
+	int old = __atomic_load_n(&max_bit, __ATOMIC_SEQ_CST);
+
+	while (old < bit_nr)
+		if (__atomic_compare_exchange_n(&max_bit, &old, bit_nr, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+}
+
+/* highest set bit up to bit_nr or -1, walks the summary backwards */
+static int prev_bit(int bit_nr)
+{
+	int word = bit_nr / BITS_PER_WORD;
+	int s = word / BITS_PER_WORD;
+	unsigned long mask, leaf;
+
+	mask = load_word(&map[word]) & (~0UL >> (BITS_PER_WORD - 1 - bit_nr % BITS_PER_WORD));
+	if (mask)
+		return word * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzl(mask);
+
+	/* summary bits below the current leaf word */
+	mask = word % BITS_PER_WORD ? load_word(&summary[s]) & (BIT(word) - 1) : 0;
+	for (;;) {
+		while (!mask) {
+			if (--s < 0)
+				return -1;
+			mask = load_word(&summary[s]);
+		}
+		word = s * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzl(mask);
+		mask &= ~BIT(word);
+		/* summary bit may be stale while a clear is in flight */
+		leaf = load_word(&map[word]);
+		if (leaf)
+			return word * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzl(leaf);
+	}
+}
+
+/*
+ * The highest bit was cleared, lower the watermark. A concurrent bm_set
+ * above the new value either is seen by the second look or sees the
+ * lowered watermark and raises it again.
+ */
+static void lower_max(int old)
+{
+	int new = old ? prev_bit(old - 1) : -1;
+
+	if (!__atomic_compare_exchange_n(&max_bit, &old, new, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return;
+	if (new + 1 < old) {
+		new = prev_bit(old - 1);
+		if (new >= 0)
+			raise_max(new);
+	}
+}
+
 void bm_set(int bit_nr)
 {
-	int byte = bit_nr / 8;
-	int bit = bit_nr % 8;
+	int word = bit_nr / BITS_PER_WORD;
 
 	access_ok(bit_nr);
 
-	pthread_mutex_lock(&mutex);
-	*(map + byte) |= 1 << bit;
-	pthread_mutex_unlock(&mutex);
-
-	//printf("set bit %d of byte %d\n", 1 << bit, byte);
+	__atomic_fetch_or(&map[word], BIT(bit_nr), __ATOMIC_SEQ_CST);
+	if (!(load_word(&summary[word / BITS_PER_WORD]) & BIT(word)))
+		__atomic_fetch_or(&summary[word / BITS_PER_WORD], BIT(word), __ATOMIC_SEQ_CST);
+	raise_max(bit_nr);
 }
 
 void bm_clear(int bit_nr)
 {
-	int byte = bit_nr / 8;
-	int bit = bit_nr % 8;
+	int word = bit_nr / BITS_PER_WORD;
+	unsigned long old;
 
 	access_ok(bit_nr);
 
-	pthread_mutex_lock(&mutex);
-	*(map + byte) &= ~(1 << bit);
-	pthread_mutex_unlock(&mutex);
+	old = __atomic_fetch_and(&map[word], ~BIT(bit_nr), __ATOMIC_SEQ_CST);
+	if (!(old & BIT(bit_nr)))
+		return;
+
+	if (!(old & ~BIT(bit_nr))) {
+		__atomic_fetch_and(&summary[word / BITS_PER_WORD], ~BIT(word), __ATOMIC_SEQ_CST);
+		/* lost against a bm_set on the same word, restore the summary */
+		if (__atomic_load_n(&map[word], __ATOMIC_SEQ_CST))
+			__atomic_fetch_or(&summary[word / BITS_PER_WORD], BIT(word), __ATOMIC_SEQ_CST);
+	}
 
-	//printf("clear bit %d of byte %d\n", 1 << bit, byte);
+	if (bit_nr == __atomic_load_n(&max_bit, __ATOMIC_SEQ_CST))
+		lower_max(bit_nr);
 }
 
 int bm_test(int bit_nr)
 {
-	int byte = bit_nr / 8;
-	int bit = bit_nr % 8;
-	int set;
-
 	access_ok(bit_nr);
 
-	pthread_mutex_lock(&mutex);
-	set = *(map + byte) & (1 << bit);
-	pthread_mutex_unlock(&mutex);
+	return !!(load_word(&map[bit_nr / BITS_PER_WORD]) & BIT(bit_nr));
+}
+
+/* highest set bit or -1 if the map is empty */
+int bm_max(void)
+{
+	return __atomic_load_n(&max_bit, __ATOMIC_RELAXED);
+}
+
+/* first non-empty leaf word from word up to last, last + 1 if there is none */
+static int next_word(int word, int last)
+{
+	int s = word / BITS_PER_WORD;
+	unsigned long mask;
+
+	if (word > last)
+		return last + 1;
 
-	if (set)
-		return 1;
-	else
-		return 0;
+	mask = load_word(&summary[s]) & (~0UL << (word % BITS_PER_WORD));
+	while (!mask) {
+		if (++s > last / BITS_PER_WORD)
+			return last + 1;
+		mask = load_word(&summary[s]);
+	}
+	word = s * BITS_PER_WORD + __builtin_ctzl(mask);
+	return word > last ? last + 1 : word;
 }
 
-// TODO: add word-wise test for performance
-//       also add max used counter to limit scan to currently highest pid!
+/*
+ * Returns the first set bit starting at bit_nr or -1 if there is none.
+ * Bits changing concurrently may or may not be seen.
+ */
+int bm_next(int bit_nr)
+{
+	int top = bm_max();
+	unsigned long mask;
+	int word, last;
+
+	if (bit_nr < 0)
+		bit_nr = 0;
+	if (bit_nr > top)
+		return -1;
+
+	last = top / BITS_PER_WORD;
+	word = bit_nr / BITS_PER_WORD;
+	mask = load_word(&map[word]) & (~0UL << (bit_nr % BITS_PER_WORD));
+	while (!mask) {
+		word = next_word(word + 1, last);
+		if (word > last)
+			return -1;
+		mask = load_word(&map[word]);
+	}
+	return word * BITS_PER_WORD + __builtin_ctzl(mask);
+}
 
 void bm_dump(void)
 {
 	int i;
 
-	printf("bitmap:\n");
-	for (i = 0; i < nr_bits; i++) {
-		if (bm_test(i))
-			printf("+");
-		else
-			printf("-");
-	}
+	printf("bitmap (max %d):\n", bm_max());
+	bm_for_each(i)
+		printf("%d ", i);
 	printf("\n");
 }
 
 /*
 int main(void)
 {
-	bm_alloc(4096); // proc 0 - 63
+	bm_alloc(4194304);
 
 	bm_set(0);
 	bm_set(1);
-	bm_set(8);
-	bm_set(4095);
+	bm_set(64);
+	bm_set(4096);
+	bm_set(4194303);
 
 	bm_dump();
 
 	bm_clear(0);
 	bm_clear(1);
-	bm_clear(8);
-	bm_clear(4095);
+	bm_clear(64);
+	bm_clear(4096);
+	bm_clear(4194303);
 
 	bm_dump();
 
@@ -10,5 +10,11 @@ void bm_destroy(void);
 void bm_set(int bit_nr);
 void bm_clear(int bit_nr);
 int bm_test(int bit_nr);
+int bm_next(int bit_nr);
+int bm_max(void);
+
+/* iterate over the set bits in ascending order */
+#define bm_for_each(bit) \
+	for ((bit) = bm_next(0); (bit) >= 0; (bit) = bm_next((bit) + 1))
 
 #endif
@@ -3,29 +3,89 @@
  * Author(s): Jan Glauber <jan.glauber@gmail.com>
  *
  * Caching layer based on pre-sorted lists.
+ *
+ * The deltas of a cycle are collected in an array together with an integer
+ * key of the sort mode and sorted once with an LSD radix sort when the output
+ * walks them. Identical keys are ordered by tid so the output does not
+ * depend on the order the deltas were added.
+ *
+ * With --top only the best rows by the sort key are kept in a bounded heap
+ * whose root is the worst kept row, every delta costs O(log K) and the
+ * rows are sorted once when the output walks them.
+ *
+ * The order by id or name hardly changes between cycles, these modes keep
+ * a persistent index with a row per thread or process instead. A row is
+ * linked with its first delta after the fork, moved if a comm or exec event
+ * shows up as a new name in a delta and dropped with the flush after the
+ * exit, a cycle only attaches the deltas to their rows and walks the index
+ * skipping idle rows. Slabs of rows that stayed unused are released.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "nlmon.h"
 #include "helper.h"
 #include "rbtree.h"
-
-struct rb_root cache_tree = RB_ROOT;
+#include "ids.h"
 
 extern enum sort_options opt_sort;
 
-int (*compare_fn) (struct taskstat_delta *t1, struct taskstat_delta *t2);
+struct sort_entry {
+	unsigned long long key;		/* ascending is the output order */
+	int tid;
+	struct taskstat_delta *delta;
+};
 
-/* sost alphabetically by task name ignoring case */
-static int compare_name(struct taskstat_delta *t1, struct taskstat_delta *t2)
-{
-	return strncasecmp(t1->comm, t2->comm, 16);
-}
+/* the arrays only grow, they are reused every cycle */
+static struct sort_entry *entries, *entries_tmp;
+static int nr_entries, max_entries;
+static int sorted;
+
+/* rows kept for --top, 0 keeps all in the array */
+static struct taskstat_delta **top_heap;
+static int top_nr;
+static int top_sorted;
+static int walk_pos;
+
+struct index_row {
+	struct rb_node node;
+	struct taskstat_delta *delta;	/* valid in the generation only */
+	unsigned int gen;
+	int id;
+	char proc;
+	char linked;
+	char comm[TS_COMM_LEN];
+};
+
+/* rows by tid and by tgid, only used for the id and name modes */
+static struct index_row *rows[2];
+static struct rb_root index_root = RB_ROOT;
+static unsigned int index_gen = 1;
+static struct rb_node *index_pos;
+static int index_shown;
+
+/*
+ * Linked rows per slab, a slab fills whole pages. Slabs that became unused
+ * are queued with the cycles they stayed unused, -1 if not queued.
+ */
+#define INDEX_IDLE_CYCLES	16
+static int slab_rows, nr_slabs;
+static int *slab_used[2], *slab_idle[2];
+static int *idle_slabs[2], nr_idle_slabs[2];
+
+/* ids of exited tasks, queued by any thread and dropped with the flush */
+static pthread_mutex_t forget_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *forget_ids;
+static int nr_forget, max_forget;
+
+int (*compare_fn) (struct taskstat_delta *t1, struct taskstat_delta *t2);
 
 /* sort by increasing tid */
 static int compare_tid(struct taskstat_delta *t1, struct taskstat_delta *t2)
@@ -54,51 +114,430 @@ static int compare_io(struct taskstat_delta *t1, struct taskstat_delta *t2)
 	return (a < b) ? 1 : (a > b) ? -1 : 0;
 }
 
+static int mem_ratio(struct taskstat_delta *t)
+{
+	return (t->utime + t->stime) ? t->rss / (t->utime + t->stime) : 0;
+}
+
 /* sort by decreasing RSS */
 static int compare_mem(struct taskstat_delta *t1, struct taskstat_delta *t2)
 {
-	int a = (t1->utime + t1->stime) ? t1->rss / (t1->utime + t1->stime) : 0;
-	int b = (t2->utime + t2->stime) ? t2->rss / (t2->utime + t2->stime) : 0;
+	int a = mem_ratio(t1);
+	int b = mem_ratio(t2);
+
+	return (a < b) ? 1 : (a > b) ? -1 : 0;
+}
+
+/* sort by decreasing cpu delay */
+static int compare_delay(struct taskstat_delta *t1, struct taskstat_delta *t2)
+{
+	unsigned long long a = t1->cpu_delay;
+	unsigned long long b = t2->cpu_delay;
+
+	return (a < b) ? 1 : (a > b) ? -1 : 0;
+}
+
+/* sort by decreasing block I/O delay */
+static int compare_iodelay(struct taskstat_delta *t1, struct taskstat_delta *t2)
+{
+	unsigned long long a = t1->blkio_delay;
+	unsigned long long b = t2->blkio_delay;
 
 	return (a < b) ? 1 : (a > b) ? -1 : 0;
 }
 
+/* identical keys are ordered by tid, smaller goes first */
+static int compare(struct taskstat_delta *t1, struct taskstat_delta *t2)
+{
+	int result = compare_fn(t1, t2);
+
+	return result ? result : compare_tid(t1, t2);
+}
+
+/* same order as compare_fn, decreasing values are inverted */
+static unsigned long long sort_key(struct taskstat_delta *t)
+{
+	switch (opt_sort) {
+	case OPT_SORT_IO:
+		return ~(t->io_rd_bytes + t->io_wr_bytes);
+	case OPT_SORT_MEM:
+		return (unsigned long long) ((long long) INT_MAX - mem_ratio(t));
+	case OPT_SORT_DELAY:
+		return ~t->cpu_delay;
+	case OPT_SORT_IODELAY:
+		return ~t->blkio_delay;
+	case OPT_SORT_TIME:
+	default:
+		return ~(t->utime + t->stime);
+	}
+}
+
+static void heap_swap(int a, int b)
+{
+	struct taskstat_delta *tmp = top_heap[a];
+
+	top_heap[a] = top_heap[b];
+	top_heap[b] = tmp;
+}
+
+/* max-heap by the output order, the root is the row printed last */
+static void sift_down(int i, int nr)
+{
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= nr)
+			break;
+		if (child + 1 < nr && compare(top_heap[child + 1], top_heap[child]) > 0)
+			child++;
+		if (compare(top_heap[child], top_heap[i]) <= 0)
+			break;
+		heap_swap(i, child);
+		i = child;
+	}
+}
+
+static void sift_up(int i)
+{
+	int parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (compare(top_heap[i], top_heap[parent]) <= 0)
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+/* keeps the delta if it is one of the best opt_top */
+static void top_add(struct taskstat_delta *data)
+{
+	if (top_nr < opt_top) {
+		top_heap[top_nr] = data;
+		sift_up(top_nr++);
+		return;
+	}
+	if (compare(data, top_heap[0]) >= 0)
+		return;
+	top_heap[0] = data;
+	sift_down(0, top_nr);
+}
+
+/* heapsort, the rows end up in output order */
+static void top_sort(void)
+{
+	int nr;
+
+	for (nr = top_nr; nr > 1; nr--) {
+		heap_swap(0, nr - 1);
+		sift_down(0, nr - 1);
+	}
+	top_sorted = 1;
+}
+
+/* passes 0-3 are the bytes of the tid, 4-11 the bytes of the key */
+#define RADIX_PASSES	12
+
+static inline unsigned int digit(struct sort_entry *e, int pass)
+{
+	if (pass < 4)
+		return ((unsigned int) e->tid >> (pass * 8)) & 0xff;
+	return (e->key >> ((pass - 4) * 8)) & 0xff;
+}
+
 /*
- * This implementation allows to have items with identical keys in tree,
- * hopefully this does not break rbtrees.
+ * Stable LSD radix sort, the tid first so it orders identical keys. All
+ * histograms are taken in one read of the array and passes where every
+ * entry has the same digit are skipped, small values need few passes.
  */
-int cache_add(struct taskstat_delta *data)
+static void radix_sort(void)
+{
+	static unsigned int count[RADIX_PASSES][256];
+	struct sort_entry *src = entries, *dst = entries_tmp, *tmp;
+	unsigned int pos, c;
+	int i, pass;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nr_entries; i++)
+		for (pass = 0; pass < RADIX_PASSES; pass++)
+			count[pass][digit(&entries[i], pass)]++;
+
+	for (pass = 0; pass < RADIX_PASSES; pass++) {
+		if (count[pass][digit(&src[0], pass)] == nr_entries)
+			continue;
+
+		for (pos = 0, c = 0; c < 256; c++) {
+			unsigned int n = count[pass][c];
+
+			count[pass][c] = pos;
+			pos += n;
+		}
+		for (i = 0; i < nr_entries; i++)
+			dst[count[pass][digit(&src[i], pass)]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != entries) {
+		entries_tmp = entries;
+		entries = src;
+	}
+}
+
+static void sort_entries(void)
 {
-	struct rb_node **new = &(cache_tree.rb_node), *parent = NULL;
+	if (nr_entries > 1)
+		radix_sort();
+	sorted = 1;
+}
+
+static void grow_entries(void)
+{
+	max_entries = max_entries ? max_entries * 2 : 1024;
+	entries = realloc(entries, max_entries * sizeof(struct sort_entry));
+	entries_tmp = realloc(entries_tmp, max_entries * sizeof(struct sort_entry));
+	if (!entries || !entries_tmp)
+		DIE_PERROR("realloc failed");
+}
+
+static int compare_rows(struct index_row *r1, struct index_row *r2)
+{
+	int result = 0;
+
+	if (opt_sort == OPT_SORT_NAME)
+		result = strncasecmp(r1->comm, r2->comm, 16);
+	if (!result)
+		result = (r1->id > r2->id) - (r1->id < r2->id);
+	return result ? result : r1->proc - r2->proc;
+}
+
+static void index_insert(struct index_row *row)
+{
+	struct rb_node **new = &(index_root.rb_node), *parent = NULL;
 
-	/* Figure out where to put new node */
 	while (*new) {
-		struct taskstat_delta *tmp = container_of(*new, struct taskstat_delta, node);
-		int result = compare_fn(data, tmp);
+		struct index_row *tmp = rb_entry(*new, struct index_row, node);
 
 		parent = *new;
-		if (result < 0)
+		if (compare_rows(row, tmp) < 0)
 			new = &((*new)->rb_left);
-		else if (result >= 0)
+		else
 			new = &((*new)->rb_right);
 	}
+	rb_link_node(&row->node, parent, new);
+	rb_insert_color(&row->node, &index_root);
+	row->linked = 1;
+}
+
+static inline int row_slab(struct index_row *row)
+{
+	return row->id / slab_rows;
+}
+
+static void index_erase(struct index_row *row)
+{
+	int proc = row->proc, slab = row_slab(row);
+
+	rb_erase(&row->node, &index_root);
+	row->linked = 0;
+	if (--slab_used[proc][slab] || slab_idle[proc][slab] >= 0)
+		return;
+	slab_idle[proc][slab] = 0;
+	idle_slabs[proc][nr_idle_slabs[proc]++] = slab;
+}
+
+/* a task that shows up twice in a cycle keeps the order of the deltas */
+static void index_add(struct taskstat_delta *data)
+{
+	int proc = data->nr_threads > 0;
+	struct taskstat_delta *last;
+	struct index_row *row;
+
+	if (data->tid <= 0 || data->tid >= pid_max) {
+		DEBUG("id %d out of range, not indexed\n", data->tid);
+		return;
+	}
+	row = &rows[proc][data->tid];
+
+	if (row->linked && opt_sort == OPT_SORT_NAME &&
+	    strncmp(row->comm, data->comm, TS_COMM_LEN))
+		index_erase(row);
+	if (!row->linked) {
+		row->id = data->tid;
+		row->proc = proc;
+		memcpy(row->comm, data->comm, TS_COMM_LEN);
+		index_insert(row);
+		slab_used[proc][row_slab(row)]++;
+	}
+
+	data->next = NULL;
+	if (row->gen != index_gen) {
+		row->delta = data;
+		row->gen = index_gen;
+		return;
+	}
+	for (last = row->delta; last->next; last = last->next)
+		;
+	last->next = data;
+}
+
+/*
+ * The thread and the process row of an exited task are dropped with the next
+ * flush, a delta that shows up later links them again. Called by any thread.
+ */
+void cache_forget(int id)
+{
+	if (!rows[0] || id <= 0 || id >= pid_max)
+		return;
+
+	pthread_mutex_lock(&forget_lock);
+	ids_add(id, &forget_ids, &nr_forget, &max_forget);
+	pthread_mutex_unlock(&forget_lock);
+}
+
+static void index_drop_forgotten(void)
+{
+	struct index_row *row;
+	int i, proc;
+
+	pthread_mutex_lock(&forget_lock);
+	for (i = 0; i < nr_forget; i++) {
+		for (proc = 0; proc < 2; proc++) {
+			row = &rows[proc][forget_ids[i]];
+			if (row->linked)
+				index_erase(row);
+		}
+	}
+	nr_forget = 0;
+	pthread_mutex_unlock(&forget_lock);
+}
+
+/* releases the slabs of rows that stayed unused for INDEX_IDLE_CYCLES */
+static void index_shrink(void)
+{
+	size_t size = slab_rows * sizeof(struct index_row);
+	int i, nr, slab, proc;
+
+	for (proc = 0; proc < 2; proc++) {
+		for (i = 0, nr = 0; i < nr_idle_slabs[proc]; i++) {
+			slab = idle_slabs[proc][i];
+			if (slab_used[proc][slab]) {
+				slab_idle[proc][slab] = -1;
+				continue;
+			}
+			if (++slab_idle[proc][slab] < INDEX_IDLE_CYCLES) {
+				idle_slabs[proc][nr++] = slab;
+				continue;
+			}
+			if (madvise(&rows[proc][slab * slab_rows], size, MADV_DONTNEED) < 0)
+				DIE_PERROR("madvise failed");
+			slab_idle[proc][slab] = -1;
+		}
+		nr_idle_slabs[proc] = nr;
+	}
+}
+
+static struct taskstat_delta *index_walk(struct taskstat_delta *last)
+{
+	struct taskstat_delta *delta;
+	struct index_row *row;
+
+	if (!last) {
+		index_pos = rb_first(&index_root);
+		index_shown = 0;
+	}
+	if (opt_top && index_shown == opt_top)
+		return NULL;
+	if (last && last->next) {
+		index_shown++;
+		return last->next;
+	}
+
+	while (index_pos) {
+		row = rb_entry(index_pos, struct index_row, node);
+		index_pos = rb_next(index_pos);
+
+		delta = (row->gen == index_gen) ? row->delta : NULL;
+		if (delta) {
+			index_shown++;
+			return delta;
+		}
+	}
+	return NULL;
+}
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int r = a % b;
+
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static void index_alloc(void)
+{
+	int i, page = sysconf(_SC_PAGESIZE);
+
+	/* the smallest number of rows that fills whole pages */
+	slab_rows = page / gcd(sizeof(struct index_row), page);
+	nr_slabs = (pid_max + slab_rows - 1) / slab_rows;
+
+	for (i = 0; i < 2; i++) {
+		rows[i] = mmap(NULL, nr_slabs * slab_rows * sizeof(struct index_row),
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (rows[i] == MAP_FAILED)
+			DIE_PERROR("mmap failed");
+		slab_used[i] = calloc(nr_slabs, sizeof(int));
+		slab_idle[i] = malloc(nr_slabs * sizeof(int));
+		idle_slabs[i] = malloc(nr_slabs * sizeof(int));
+		if (!slab_used[i] || !slab_idle[i] || !idle_slabs[i])
+			DIE_PERROR("allocating index slabs failed");
+		memset(slab_idle[i], 0xff, nr_slabs * sizeof(int));
+	}
+	DEBUG("sort index: %d slabs of %d rows, %zu bytes each\n",
+		nr_slabs, slab_rows, slab_rows * sizeof(struct index_row));
+}
 
-	/* Add new node and rebalance tree. */
-	rb_link_node(&data->node, parent, new);
-	rb_insert_color(&data->node, &cache_tree);
+/* the delta must not change until the cache is flushed */
+int cache_add(struct taskstat_delta *data)
+{
+	struct sort_entry *e;
 
+	if (rows[0]) {
+		index_add(data);
+		return 1;
+	}
+	if (opt_top) {
+		top_add(data);
+		return 1;
+	}
+
+	if (nr_entries == max_entries)
+		grow_entries();
+	e = &entries[nr_entries++];
+	e->key = sort_key(data);
+	e->tid = data->tid;
+	e->delta = data;
 	return 1;
 }
 
 void cache_init(void)
 {
+	/* the order by id or name is kept across the cycles */
+	if (opt_sort == OPT_SORT_TID || opt_sort == OPT_SORT_NAME) {
+		index_alloc();
+		return;
+	}
+
 	switch (opt_sort) {
-		case OPT_SORT_TID:
-			compare_fn = &compare_tid;
-			break;
-		case OPT_SORT_NAME:
-			compare_fn = &compare_name;
-			break;
 		case OPT_SORT_TIME:
 			compare_fn = &compare_time;
 			break;
@@ -108,33 +547,224 @@ void cache_init(void)
 		case OPT_SORT_MEM:
 			compare_fn = &compare_mem;
 			break;
+		case OPT_SORT_DELAY:
+			compare_fn = &compare_delay;
+			break;
+		case OPT_SORT_IODELAY:
+			compare_fn = &compare_iodelay;
+			break;
 		default:
 			compare_fn = &compare_time;
 	}
+
+	if (opt_top) {
+		top_heap = calloc(opt_top, sizeof(struct taskstat_delta *));
+		if (!top_heap)
+			DIE_PERROR("calloc failed");
+	}
 }
 
+/* sorts on the first call of a cycle */
 struct taskstat_delta *cache_walk(struct taskstat_delta *last)
 {
-	struct rb_node *node = (last) ? rb_next(&last->node) : rb_first(&cache_tree);
+	if (rows[0])
+		return index_walk(last);
+	if (opt_top) {
+		if (!top_sorted)
+			top_sort();
+		if (!last)
+			walk_pos = 0;
+		return walk_pos < top_nr ? top_heap[walk_pos++] : NULL;
+	}
 
-	if (!node)
-		return NULL;
-	else
-		return rb_entry(node, struct taskstat_delta, node);
+	if (!sorted)
+		sort_entries();
+	if (!last)
+		walk_pos = 0;
+	return walk_pos < nr_entries ? entries[walk_pos++].delta : NULL;
 }
 
-/* remove all elements after cycle is done */
+/* forget all elements after cycle is done, the deltas are owned by the arenas */
 void cache_flush(void)
 {
-	struct taskstat_delta *data;
-	struct rb_node *node;
+	if (rows[0]) {
+		index_drop_forgotten();
+		index_shrink();
+	}
+	index_gen++;
+	nr_entries = 0;
+	sorted = 0;
+	top_nr = 0;
+	top_sorted = 0;
+}
+
+#ifdef CACHE_BENCH
+/*
+ * Compares the former rbtree against the cache, the id and name modes are
+ * timed for the first cycle that fills the index and for the next one. The
+ * walks are checked against a qsort of the deltas:
+ *   gcc -O2 -fcommon -DCACHE_BENCH -o cache_bench cache.c rbtree.c ids.c -lpthread
+ */
+#include <time.h>
+
+FILE *logfile;
+int opt_top;
+int pid_max = 4194304;
+enum sort_options opt_sort = OPT_SORT_TIME;
+
+struct tree_node {
+	struct rb_node node;
+	struct taskstat_delta *delta;
+};
+
+static struct rb_root bench_tree = RB_ROOT;
+
+/* the order of the index modes, compare_fn for the others */
+static int bench_compare(struct taskstat_delta *t1, struct taskstat_delta *t2)
+{
+	int result = 0;
 
-	do {
-		node = rb_first(&cache_tree);
-		if (!node)
-			continue;
-		data = rb_entry(node, struct taskstat_delta, node);
-		rb_erase(&data->node, &cache_tree);
-		free(data);
-	} while (rb_first(&cache_tree) != NULL);
+	if (opt_sort == OPT_SORT_NAME)
+		result = strncasecmp(t1->comm, t2->comm, 16);
+	else if (opt_sort != OPT_SORT_TID)
+		result = compare_fn(t1, t2);
+	return result ? result : compare_tid(t1, t2);
+}
+
+static int bench_qsort_cmp(const void *a, const void *b)
+{
+	return bench_compare(*(struct taskstat_delta **) a, *(struct taskstat_delta **) b);
+}
+
+static void tree_add(struct tree_node *n)
+{
+	struct rb_node **new = &(bench_tree.rb_node), *parent = NULL;
+
+	while (*new) {
+		struct tree_node *tmp = container_of(*new, struct tree_node, node);
+
+		parent = *new;
+		if (bench_compare(n->delta, tmp->delta) < 0)
+			new = &((*new)->rb_left);
+		else
+			new = &((*new)->rb_right);
+	}
+	rb_link_node(&n->node, parent, new);
+	rb_insert_color(&n->node, &bench_tree);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void fill(struct taskstat_delta *d, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		memset(&d[i], 0, sizeof(d[i]));
+		d[i].tid = 1 + i * 7 % 4194303;
+		d[i].utime = random() % 20000;
+		d[i].stime = random() % 20000;
+		d[i].rss = random() % 100000;
+		d[i].io_rd_bytes = random() % 1000000;
+		snprintf(d[i].comm, sizeof(d[i].comm), "worker/%d", d[i].tid % 64);
+	}
+}
+
+/* one cycle through the cache, returns the number of rows out of order */
+static int cache_cycle(struct taskstat_delta *d, int n, struct taskstat_delta **walked, double *us)
+{
+	struct taskstat_delta *walk;
+	double t0 = now_us();
+	int i, nr = 0, bad = 0;
+
+	for (i = 0; i < n; i++)
+		cache_add(&d[i]);
+	for (walk = cache_walk(NULL); walk && nr < n; walk = cache_walk(walk))
+		walked[nr++] = walk;
+	cache_flush();
+	*us = now_us() - t0;
+
+	for (i = 0; i < n; i++)
+		walked[n + i] = &d[i];
+	qsort(&walked[n], n, sizeof(struct taskstat_delta *), bench_qsort_cmp);
+	for (i = 0; i < n; i++)
+		if (i >= nr || walked[i] != walked[n + i])
+			bad++;
+	return bad;
+}
+
+static void index_reset(void)
+{
+	int i;
+
+	for (i = 0; i < 2 && rows[i]; i++) {
+		munmap(rows[i], nr_slabs * slab_rows * sizeof(struct index_row));
+		free(slab_used[i]);
+		free(slab_idle[i]);
+		free(idle_slabs[i]);
+		nr_idle_slabs[i] = 0;
+	}
+	rows[0] = rows[1] = NULL;
+	index_root = RB_ROOT;
+}
+
+static void bench(int n, enum sort_options mode, const char *name)
+{
+	struct taskstat_delta *d = calloc(n, sizeof(*d));
+	struct tree_node *nodes = calloc(n, sizeof(*nodes));
+	struct taskstat_delta **walked = calloc(2 * n, sizeof(*walked));
+	double t0, t_tree, t_first, t_next;
+	unsigned long sum = 0;
+	struct rb_node *rb;
+	int i, bad;
+
+	opt_sort = mode;
+	cache_init();
+	fill(d, n);
+
+	t0 = now_us();
+	bench_tree = RB_ROOT;
+	for (i = 0; i < n; i++) {
+		nodes[i].delta = &d[i];
+		tree_add(&nodes[i]);
+	}
+	for (rb = rb_first(&bench_tree); rb; rb = rb_next(rb))
+		sum += container_of(rb, struct tree_node, node)->delta->tid;
+	t_tree = now_us() - t0;
+
+	bad = cache_cycle(d, n, walked, &t_first);
+	fill(d, n);
+	bad += cache_cycle(d, n, walked, &t_next);
+
+	printf("%7d %-5s  rbtree: %8.0f us  first: %8.0f us  next: %8.0f us  speed-up: %5.1fx",
+		n, name, t_tree, t_first, t_next, t_tree / t_next);
+	if (bad)
+		printf("  %d rows out of order", bad);
+	printf("\n");
+	index_reset();
+	free(walked);
+	free(d);
+	free(nodes);
+}
+
+int main(void)
+{
+	int sizes[] = { 1000, 10000, 100000 };
+	int i;
+
+	logfile = stderr;
+	srandom(1);
+	for (i = 0; i < 3; i++) {
+		bench(sizes[i], OPT_SORT_TIME, "time");
+		bench(sizes[i], OPT_SORT_NAME, "name");
+		bench(sizes[i], OPT_SORT_TID, "id");
+	}
+	return 0;
 }
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Cgroup scoped monitoring.
+ *
+ * Only the tasks of the selected cgroup v2 subtrees are tracked. The tasks
+ * are seeded from cgroup.threads, forks are followed if the parent is
+ * tracked and moves between cgroups are picked up by a periodic resync.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <mntent.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "nlmon.h"
+#include "ids.h"
+
+#define CGROUP_MAX	16
+
+/* cgroup v2 mount point */
+static char cgroup_root[256];
+
+/* relative to the root, "/" for the whole hierarchy */
+static char *cgroups[CGROUP_MAX];
+static int nr_cgroups;
+
+int cgroup_scoped(void)
+{
+	return nr_cgroups;
+}
+
+static int find_cgroup_root(void)
+{
+	struct mntent *ent;
+	FILE *fp;
+
+	fp = setmntent("/proc/self/mounts", "r");
+	if (!fp)
+		return -1;
+	while ((ent = getmntent(fp)) != NULL) {
+		if (strcmp(ent->mnt_type, "cgroup2"))
+			continue;
+		snprintf(cgroup_root, sizeof(cgroup_root), "%s", ent->mnt_dir);
+		break;
+	}
+	endmntent(fp);
+	return cgroup_root[0] ? 0 : -1;
+}
+
+/* accepts paths below the mount point or relative to it */
+int cgroup_add(const char *path)
+{
+	char name[512];
+	size_t len;
+	char *rel;
+
+	if (nr_cgroups == CGROUP_MAX)
+		return -1;
+	if (!cgroup_root[0] && find_cgroup_root() < 0)
+		return -1;
+
+	len = strlen(cgroup_root);
+	if (!strncmp(path, cgroup_root, len) && (path[len] == '/' || !path[len]))
+		path += len;
+	while (*path == '/')
+		path++;
+
+	if (asprintf(&rel, "/%s", path) < 0)
+		DIE_PERROR("asprintf failed");
+	len = strlen(rel);
+	while (len > 1 && rel[len - 1] == '/')
+		rel[--len] = 0;
+
+	snprintf(name, sizeof(name), "%s%s/cgroup.threads", cgroup_root, rel);
+	if (access(name, R_OK)) {
+		free(rel);
+		return -1;
+	}
+	cgroups[nr_cgroups++] = rel;
+	return 0;
+}
+
+/* cgroup.threads only lists the cgroup itself, walk the subtree */
+static void read_subtree(const char *dir, int **tids, int *nr, int *max)
+{
+	struct dirent *dentry;
+	char name[512];
+	FILE *fp;
+	DIR *d;
+	int tid;
+
+	snprintf(name, sizeof(name), "%s/cgroup.threads", dir);
+	fp = fopen(name, "r");
+	if (!fp)
+		return;
+	while (fscanf(fp, "%d", &tid) == 1)
+		ids_add(tid, tids, nr, max);
+	fclose(fp);
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((dentry = readdir(d)) != NULL) {
+		if (dentry->d_type != DT_DIR || dentry->d_name[0] == '.')
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", dir, dentry->d_name);
+		read_subtree(name, tids, nr, max);
+	}
+	closedir(d);
+}
+
+/* tids of all tasks in the selected cgroups, the array grows as needed */
+int cgroup_read_tids(int **tids, int *max)
+{
+	char dir[512];
+	int i, nr = 0;
+
+	for (i = 0; i < nr_cgroups; i++) {
+		snprintf(dir, sizeof(dir), "%s%s", cgroup_root,
+			 strcmp(cgroups[i], "/") ? cgroups[i] : "");
+		read_subtree(dir, tids, &nr, max);
+	}
+	return nr;
+}
+
+/* checks the v2 entry of /proc/<tid>/cgroup against the selected cgroups */
+int cgroup_member(int tid)
+{
+	char name[32], line[512];
+	int i, member = 0;
+	size_t len;
+	FILE *fp;
+
+	snprintf(name, sizeof(name), "/proc/%d/cgroup", tid);
+	fp = fopen(name, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		for (i = 0; i < nr_cgroups && !member; i++) {
+			len = strlen(cgroups[i]);
+			if (len == 1 || (!strncmp(line + 3, cgroups[i], len) &&
+			    (line[3 + len] == '/' || !line[3 + len])))
+				member = 1;
+		}
+		break;
+	}
+	fclose(fp);
+	return member;
+}
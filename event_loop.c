@@ -0,0 +1,178 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Single threaded event loop.
+ *
+ * Instead of separate threads for the connector, the procfs scan, the exit
+ * records and the sweep everything is multiplexed on one epoll instance.
+ * Fork and exit events and taskstats replies are handled as they arrive,
+ * a timerfd fires at the cycle deadlines and a signalfd allows a clean
+ * shutdown.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "query.h"
+#include "nlmon.h"
+
+/* epoll data, exit record sockets follow after EV_EXIT */
+enum {
+	EV_CONNECTOR,
+	EV_TASKSTATS,
+	EV_TIMER,
+	EV_SIGNAL,
+	EV_EXIT,
+};
+
+static int epfd;
+
+static void ev_add(int fd, int tag)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		DIE_PERROR("epoll_ctl failed");
+}
+
+static void arm_timer(int tfd)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	clockid_t clock;
+
+	cycle_deadline(&clock, &its.it_value);
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		DIE_PERROR("timerfd_settime failed");
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / NSECS_PER_MSEC;
+}
+
+/* blocked signals are inherited, call before any other thread is created */
+void block_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGHUP);
+	if (pthread_sigmask(SIG_BLOCK, mask, NULL))
+		DIE_PERROR("pthread_sigmask failed");
+}
+
+void run_event_loop(int nl_fd, int cycles)
+{
+	struct query_sock *qs = sweep_socket();
+	struct query_sock *exit_socks;
+	struct epoll_event events[16];
+	unsigned long long progress = 0;
+	int tfd, sfd, nr_exit, i, n;
+	int sweeping, submitted;
+	struct signalfd_siginfo si;
+	unsigned long long ticks;
+	clockid_t clock;
+	struct timespec ts;
+	sigset_t mask;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		DIE_PERROR("epoll_create1 failed");
+
+	block_signals(&mask);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sfd < 0)
+		DIE_PERROR("signalfd failed");
+
+	cycle_deadline(&clock, &ts);
+	tfd = timerfd_create(clock, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd < 0)
+		DIE_PERROR("timerfd_create failed");
+
+	ev_add(nl_fd, EV_CONNECTOR);
+	ev_add(qs->fd, EV_TASKSTATS);
+	ev_add(tfd, EV_TIMER);
+	ev_add(sfd, EV_SIGNAL);
+	exit_socks = exit_records_socks(&nr_exit);
+	for (i = 0; i < nr_exit; i++)
+		ev_add(exit_socks[i].fd, EV_EXIT + i);
+
+	/* the startup scan established the baselines, wait for the first deadline */
+	arm_timer(tfd);
+	sweeping = 0;
+	submitted = 0;
+
+	while (cycles) {
+		if (sweeping && !submitted) {
+			submitted = sweep_step();
+			progress = now_ms();
+		}
+		if (sweeping && submitted && !qs->inflight) {
+			cycle_end();
+			nr_cycles++;
+			sweeping = 0;
+			if (!--cycles)
+				break;
+			arm_timer(tfd);
+		}
+
+		n = epoll_wait(epfd, events, 16, sweeping ? QUERY_TIMEOUT_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			DIE_PERROR("epoll_wait failed");
+		}
+
+		/* busy connector must not delay the reissue of lost requests */
+		if (sweeping && qs->inflight && now_ms() - progress >= QUERY_TIMEOUT_MS) {
+			query_reissue(qs);
+			progress = now_ms();
+		}
+
+		for (i = 0; i < n; i++) {
+			switch (events[i].data.u32) {
+			case EV_CONNECTOR:
+				proc_events_recv(nl_fd);
+				break;
+			case EV_TASKSTATS:
+				query_recv_async(qs);
+				progress = now_ms();
+				break;
+			case EV_TIMER:
+				if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+					break;
+				cycle_begin();
+				sweep_begin();
+				sweeping = 1;
+				submitted = 0;
+				break;
+			case EV_SIGNAL:
+				if (read(sfd, &si, sizeof(si)) != sizeof(si))
+					break;
+				DEBUG("signal %d, shutting down\n", si.ssi_signo);
+				cycles = 0;
+				break;
+			default:
+				query_recv_async(&exit_socks[events[i].data.u32 - EV_EXIT]);
+			}
+		}
+	}
+
+	close(tfd);
+	close(sfd);
+	close(epfd);
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Taskstats exit record listener.
+ *
+ * The kernel sends a final taskstats record for every exiting task to all
+ * sockets that registered the CPU the task died on. The record is credited
+ * against the last baseline of the task so short-lived threads and the last
+ * interval of every other thread are accounted in the cycle they died.
+ *
+ * Exit bursts can overrun a single socket so the CPUs may be split up into
+ * several shards, each with its own socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "table.h"
+#include "arena.h"
+#include "query.h"
+#include "nlmon.h"
+
+int opt_exit_shards = 1;
+
+static struct query_sock *exit_socks;
+static char **exit_cpumasks;
+static int nr_exit_socks;
+
+/* deltas of exited tasks for the current cycle */
+static pthread_mutex_t exit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct taskstat_delta *exit_deltas;
+
+/*
+ * The queued deltas live in one arena while the collected ones of the
+ * cycle that is printed live in the other, collecting swaps them.
+ */
+static struct arena exit_arenas[2];
+static int exit_arena;
+
+static unsigned long nr_exit_records;
+static unsigned long nr_unknown_records;
+
+/* the delta is copied, a collect may swap the arenas at any time */
+static void queue_exit_delta(struct taskstat_delta *delta)
+{
+	struct taskstat_delta *copy;
+
+	pthread_mutex_lock(&exit_mutex);
+	copy = arena_alloc(&exit_arenas[exit_arena], sizeof(struct taskstat_delta));
+	*copy = *delta;
+	copy->next = exit_deltas;
+	exit_deltas = copy;
+	pthread_mutex_unlock(&exit_mutex);
+}
+
+/* a short-lived task belongs to the cgroups if its process or parent is tracked */
+static int cgroup_parent_known(struct taskstats *t)
+{
+	struct task_entry *p;
+
+	p = get_proc_entry(t->ac_tgid);
+	if (p) {
+		put_task_entry(t->ac_tgid);
+		return 1;
+	}
+	p = get_proc_entry(t->ac_ppid);
+	if (p) {
+		put_task_entry(t->ac_ppid);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Credit the death of a collapsed process. The group record holds the
+ * totals of the whole process, if the process was never multi-threaded
+ * the record of the leader is the final one. The thread record t is the
+ * one that came with it.
+ */
+static void handle_proc_exit(struct taskstats *final, struct taskstats *t)
+{
+	struct taskstat_delta delta;
+	struct task_entry zero = { 0 }, *p;
+	int tgid = t->ac_tgid;
+
+	memset(&delta, 0, sizeof(struct taskstat_delta));
+	delta.pid = tgid;
+	delta.tid = tgid;
+	delta.nr_threads = 1;
+
+	p = get_proc_entry(tgid);
+	if (!p) {
+		/* with --per-process a process that lived and died unknown is still shown */
+		if (opt_collapse || (cgroup_scoped() && !cgroup_parent_known(t)))
+			return;
+		calc_proc_delta(&zero, final, &delta);
+		memcpy(&delta.comm, t->ac_comm, TS_COMM_LEN);
+		nr_unknown_records++;
+		queue_exit_delta(&delta);
+		return;
+	}
+	/* with --per-process the whole life of a short-lived process counts */
+	if (!p->have_baseline && opt_collapse) {
+		put_task_entry(tgid);
+		remove_proc_entry(tgid);
+		return;
+	}
+
+	calc_proc_delta(p, final, &delta);
+	memcpy(&delta.comm, p->comm[0] ? p->comm : t->ac_comm, TS_COMM_LEN);
+	put_task_entry(tgid);
+	remove_proc_entry(tgid);
+
+	queue_exit_delta(&delta);
+}
+
+static void handle_exit_record(struct taskstats *t, struct taskstats *group, void *unused)
+{
+	struct taskstat_delta delta;
+	struct task_entry *h, *p;
+	int collapsed, last = 1;
+
+	nr_exit_records++;
+	if (!proc_watched(t->ac_tgid))
+		return;
+
+	/* with --per-process a process is collapsed before its first sweep */
+	collapsed = opt_collapse == 0;
+	p = get_proc_entry(t->ac_tgid);
+	if (p) {
+		collapsed |= p->collapsed;
+		last = p->nr_threads <= 1;
+		put_task_entry(t->ac_tgid);
+	}
+
+	/*
+	 * The final interval of a thread of a collapsed process shows up in
+	 * the next tgid query. The kernel sends the group record if the
+	 * process was ever multi-threaded, otherwise the leader is the last.
+	 */
+	if (collapsed) {
+		remove_task_entry(t->ac_pid);
+		if (group)
+			handle_proc_exit(group, t);
+		else if (t->ac_pid == t->ac_tgid && last)
+			handle_proc_exit(t, t);
+		return;
+	}
+
+	memset(&delta, 0, sizeof(struct taskstat_delta));
+	delta.tid = t->ac_pid;
+
+	h = get_task_entry(t->ac_pid);
+	if (h) {
+		delta.pid = h->tgid;
+		calc_delta(h, t, &delta);
+		put_task_entry(t->ac_pid);
+		remove_task_entry(t->ac_pid);
+	} else {
+		/* the task lived and died before we knew about it */
+		struct task_entry zero = { 0 };
+
+		if (cgroup_scoped() && !cgroup_parent_known(t))
+			return;
+
+		delta.pid = t->ac_tgid;
+		calc_delta(&zero, t, &delta);
+		nr_unknown_records++;
+	}
+	memcpy(&delta.comm, t->ac_comm, TS_COMM_LEN);
+
+	queue_exit_delta(&delta);
+}
+
+/* hand out all deltas of tasks that exited since the last call */
+struct taskstat_delta *collect_exit_records(void)
+{
+	struct taskstat_delta *list;
+
+	pthread_mutex_lock(&exit_mutex);
+	list = exit_deltas;
+	exit_deltas = NULL;
+	exit_arena ^= 1;
+	pthread_mutex_unlock(&exit_mutex);
+	return list;
+}
+
+/* drops the collected deltas after the output of the cycle */
+void exit_records_reset(void)
+{
+	pthread_mutex_lock(&exit_mutex);
+	arena_reset(&exit_arenas[exit_arena ^ 1]);
+	pthread_mutex_unlock(&exit_mutex);
+}
+
+static void *exit_records_main(void *unused)
+{
+	struct pollfd *pfd;
+	int i, rc;
+
+	pfd = calloc(nr_exit_socks, sizeof(struct pollfd));
+	if (!pfd)
+		DIE_PERROR("calloc failed");
+	for (i = 0; i < nr_exit_socks; i++) {
+		pfd[i].fd = exit_socks[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	/* endless loop */
+	for (;;) {
+		rc = poll(pfd, nr_exit_socks, -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			DIE_PERROR("poll failed");
+		}
+		for (i = 0; i < nr_exit_socks; i++)
+			if (pfd[i].revents)
+				query_recv_async(&exit_socks[i]);
+	}
+	return NULL;
+}
+
+/* without a listener thread the caller has to poll the sockets */
+void start_exit_records(int listener)
+{
+	pthread_t thread;
+	int i, first, last, rc;
+
+	arena_init(&exit_arenas[0], DELTA_ARENA_CHUNK);
+	arena_init(&exit_arenas[1], DELTA_ARENA_CHUNK);
+
+	nr_exit_socks = min(opt_exit_shards, nr_cpus);
+	exit_socks = calloc(nr_exit_socks, sizeof(struct query_sock));
+	exit_cpumasks = calloc(nr_exit_socks, sizeof(char *));
+	if (!exit_socks || !exit_cpumasks)
+		DIE_PERROR("calloc failed");
+
+	for (i = 0; i < nr_exit_socks; i++) {
+		first = i * nr_cpus / nr_exit_socks;
+		last = (i + 1) * nr_cpus / nr_exit_socks - 1;
+
+		exit_cpumasks[i] = malloc(24);	/* enough for "4095-4096" :) */
+		if (!exit_cpumasks[i])
+			DIE_PERROR("malloc failed");
+		snprintf(exit_cpumasks[i], 24, "%d-%d", first, last);
+
+		/* no requests are sent, one slot is enough */
+		query_open(&exit_socks[i], 1);
+		exit_socks[i].async_handler = handle_exit_record;
+
+		DEBUG("Starting task exit listener on CPUs %s\n", exit_cpumasks[i]);
+		rc = query_register_cpumask(&exit_socks[i], exit_cpumasks[i], 1);
+		if (rc < 0)
+			DIE("send cmd failed with error %d\n", rc);
+	}
+	if (!listener)
+		return;
+
+	rc = pthread_create(&thread, NULL, exit_records_main, NULL);
+	if (rc)
+		DIE_PERROR("pthread_create failed");
+	pthread_setname_np(thread, "nlmon-exit");
+}
+
+struct query_sock *exit_records_socks(int *nr)
+{
+	*nr = nr_exit_socks;
+	return exit_socks;
+}
+
+void stop_exit_records(void)
+{
+	unsigned long overruns = 0;
+	int i;
+
+	for (i = 0; i < nr_exit_socks; i++) {
+		query_register_cpumask(&exit_socks[i], exit_cpumasks[i], 0);
+		overruns += exit_socks[i].overruns;
+	}
+	DEBUG("exit records: %lu  unknown tasks: %lu  overruns: %lu\n",
+		nr_exit_records, nr_unknown_records, overruns);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * High frequency sampling of selected threads.
+ *
+ * A handful of threads is queried on its own schedule with a separate
+ * taskstats socket and separate baselines while the full sweep continues
+ * at the normal interval. Targets are selected by pid, tid or by a comm
+ * pattern and are picked up from the replies of the full sweep.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "table.h"
+#include "query.h"
+#include "nlmon.h"
+#include "ids.h"
+
+#define HF_MAX_TARGETS	64
+#define HF_MAX_IDS	64
+
+int opt_hf_interval_ms = 20;
+char *opt_hf_comm;
+
+/* pids or tids from the command line */
+static int hf_ids[HF_MAX_IDS];
+static int nr_hf_ids;
+
+struct hf_target {
+	struct task_entry base;		/* baseline, not part of the table */
+	struct taskstat_delta delta;	/* sample of the current tick */
+	int sampled;
+};
+
+static pthread_mutex_t hf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hf_target hf_targets[HF_MAX_TARGETS];
+static int nr_hf_targets;
+
+static struct query_sock hf_qs;
+static pthread_t hf_thread;
+static volatile int hf_stop;
+static unsigned long nr_hf_ticks;
+static unsigned long nr_hf_overruns;
+
+int hf_enabled(void)
+{
+	return nr_hf_ids || opt_hf_comm;
+}
+
+/* parse a comma separated list of pids or tids */
+int hf_parse_ids(char *list)
+{
+	return ids_parse(list, hf_ids, &nr_hf_ids, HF_MAX_IDS);
+}
+
+static int hf_wanted(struct taskstats *t)
+{
+	int i;
+
+	for (i = 0; i < nr_hf_ids; i++)
+		if (hf_ids[i] == t->ac_pid || hf_ids[i] == t->ac_tgid)
+			return 1;
+	return opt_hf_comm && !fnmatch(opt_hf_comm, t->ac_comm, 0);
+}
+
+static struct hf_target *hf_find(int tid)
+{
+	int i;
+
+	for (i = 0; i < nr_hf_targets; i++)
+		if (hf_targets[i].base.tid == tid)
+			return &hf_targets[i];
+	return NULL;
+}
+
+/* called with every reply of the full sweep to pick up new targets */
+void hf_watch(struct taskstats *t)
+{
+	struct hf_target *target;
+
+	if (!hf_wanted(t))
+		return;
+
+	pthread_mutex_lock(&hf_mutex);
+	if (hf_find(t->ac_pid))
+		goto out;
+	if (nr_hf_targets == HF_MAX_TARGETS) {
+		DEBUG("too many sampling targets, ignoring %d\n", t->ac_pid);
+		goto out;
+	}
+
+	/* the first sample only establishes the baseline */
+	target = &hf_targets[nr_hf_targets++];
+	memset(target, 0, sizeof(*target));
+	target->base.tid = t->ac_pid;
+	target->base.tgid = t->ac_tgid;
+	DEBUG("sampling %d [%s] every %d ms\n", t->ac_pid, t->ac_comm, opt_hf_interval_ms);
+out:
+	pthread_mutex_unlock(&hf_mutex);
+}
+
+static void hf_remove(int tid)
+{
+	struct hf_target *target;
+
+	pthread_mutex_lock(&hf_mutex);
+	target = hf_find(tid);
+	if (target) {
+		DEBUG("sampling target %d gone\n", tid);
+		*target = hf_targets[--nr_hf_targets];
+	}
+	pthread_mutex_unlock(&hf_mutex);
+}
+
+static void hf_reply(struct taskstats *t, int id, int type, void *unused)
+{
+	struct hf_target *target;
+
+	pthread_mutex_lock(&hf_mutex);
+	target = hf_find(t->ac_pid);
+	if (!target)
+		goto out;
+
+	memset(&target->delta, 0, sizeof(target->delta));
+	calc_delta(&target->base, t, &target->delta);
+	if (!target->base.have_baseline) {
+		target->base.have_baseline = 1;
+		goto out;
+	}
+	target->delta.pid = target->base.tgid;
+	target->delta.tid = target->base.tid;
+	memcpy(target->delta.comm, t->ac_comm, TS_COMM_LEN);
+	target->sampled = 1;
+out:
+	pthread_mutex_unlock(&hf_mutex);
+}
+
+static void hf_error(int id, int type, int error, void *unused)
+{
+	if (error == -ESRCH)
+		hf_remove(id);
+	else
+		fprintf(stderr, "reply error for %d, errno %d\n", id, error);
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_nsec += (long) ms * NSECS_PER_MSEC;
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void hf_tick(struct timespec *deadline)
+{
+	int tids[HF_MAX_TARGETS];
+	struct timespec ts;
+	int i, nr;
+
+	/* the handler takes the lock, do not hold it while submitting */
+	pthread_mutex_lock(&hf_mutex);
+	for (nr = 0; nr < nr_hf_targets; nr++)
+		tids[nr] = hf_targets[nr].base.tid;
+	pthread_mutex_unlock(&hf_mutex);
+
+	for (i = 0; i < nr; i++)
+		query_submit(&hf_qs, tids[i], TASKSTATS_CMD_ATTR_PID);
+	query_drain(&hf_qs);
+
+	/* samples are stamped with the scheduled time of the tick */
+	elapsed_time(deadline, &ts);
+
+	pthread_mutex_lock(&output_lock);
+	pthread_mutex_lock(&hf_mutex);
+	for (i = 0; i < nr_hf_targets; i++) {
+		if (!hf_targets[i].sampled)
+			continue;
+		output->print_sample(&ts, &hf_targets[i].delta);
+		hf_targets[i].sampled = 0;
+	}
+	pthread_mutex_unlock(&hf_mutex);
+	pthread_mutex_unlock(&output_lock);
+	nr_hf_ticks++;
+}
+
+static void *hf_sample_main(void *unused)
+{
+	struct timespec deadline, next, now;
+	int rc;
+
+	rc = clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (rc < 0)
+		DIE_PERROR("clock_gettime failed");
+
+	while (!hf_stop) {
+		timespec_add_ms(&deadline, opt_hf_interval_ms);
+		while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
+			;
+		if (rc)
+			DIE("clock_nanosleep failed with error %d\n", rc);
+
+		hf_tick(&deadline);
+
+		/* skip the ticks we are already late for */
+		rc = clock_gettime(CLOCK_MONOTONIC, &now);
+		if (rc < 0)
+			DIE_PERROR("clock_gettime failed");
+		for (;;) {
+			next = deadline;
+			timespec_add_ms(&next, opt_hf_interval_ms);
+			if (!timespec_before(&next, &now))
+				break;
+			deadline = next;
+			nr_hf_overruns++;
+		}
+	}
+	return NULL;
+}
+
+void start_hf_sampling(void)
+{
+	int rc;
+
+	query_open(&hf_qs, HF_MAX_TARGETS);
+	hf_qs.handler = hf_reply;
+	hf_qs.error_handler = hf_error;
+
+	rc = pthread_create(&hf_thread, NULL, hf_sample_main, NULL);
+	if (rc)
+		DIE_PERROR("pthread_create failed");
+	pthread_setname_np(hf_thread, "nlmon-hf");
+}
+
+/* the sampler finishes the current tick before it stops */
+void stop_hf_sampling(void)
+{
+	hf_stop = 1;
+	pthread_join(hf_thread, NULL);
+	DEBUG("sampling ticks: %lu  overruns: %lu\n", nr_hf_ticks, nr_hf_overruns);
+	query_close(&hf_qs);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Lists of pids or tids.
+ *
+ * Scans collect ids into arrays that double when full, the options take
+ * comma separated ids into fixed arrays.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "nlmon.h"
+#include "ids.h"
+
+/* appends the id, the array grows as needed */
+void ids_add(int id, int **ids, int *nr, int *max)
+{
+	if (*nr == *max) {
+		*max = *max ? *max * 2 : 64;
+		*ids = realloc(*ids, *max * sizeof(int));
+		if (!*ids)
+			DIE_PERROR("realloc failed");
+	}
+	(*ids)[(*nr)++] = id;
+}
+
+/*
+ * Parses a comma separated list of ids below pid_max, appended to the nr
+ * ids that are there already. Returns -1 if an id is invalid, the array is
+ * full or the list is empty.
+ */
+int ids_parse(const char *list, int *ids, int *nr, int max)
+{
+	char *tok, *end, *copy;
+	long id;
+
+	copy = strdup(list);
+	if (!copy)
+		DIE_PERROR("strdup failed");
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		id = strtol(tok, &end, 10);
+		if (*end || id <= 0 || id >= pid_max || *nr == max) {
+			free(copy);
+			return -1;
+		}
+		ids[(*nr)++] = id;
+	}
+	free(copy);
+	return *nr ? 0 : -1;
+}
@@ -0,0 +1,12 @@
+#ifndef _IDS_H
+#define _IDS_H
+
+/*
+ * Lists of pids or tids
+ */
+
+/* id list interface prototypes */
+void ids_add(int id, int **ids, int *nr, int *max);
+int ids_parse(const char *list, int *ids, int *nr, int max);
+
+#endif
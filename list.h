@@ -6,6 +6,8 @@
 #ifndef _LIST_H
 #define _LIST_H
 
+#include <stddef.h>
+
 struct list_head {
 	struct list_head *prev, *next;
 };
@@ -36,4 +38,19 @@ static inline int list_is_empty(struct list_head *head)
 	return head->next == head;
 }
 
+/* entry is re-initialized and can be tested with list_is_empty() */
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	list_init(entry);
+}
+
+#define list_entry(ptr, type, member)					\
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define list_for_each_safe(pos, n, head)				\
+	for (pos = (head)->next, n = pos->next; pos != (head);		\
+	     pos = n, n = pos->next)
+
 #endif /* _LIST_H */
@@ -0,0 +1,45 @@
+/*
+ * Netlink attribute iterator with bounds checking.
+ * Derived from Linux kernel include/net/netlink.h.
+ */
+
+#ifndef _NLATTR_H
+#define _NLATTR_H
+
+#include <linux/netlink.h>
+
+static inline void *nla_data(const struct nlattr *nla)
+{
+	return (char *) nla + NLA_HDRLEN;
+}
+
+static inline int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+
+/* check that the attribute header and its payload fit into the remaining bytes */
+static inline int nla_ok(const struct nlattr *nla, int remaining)
+{
+	return remaining >= (int) sizeof(*nla) &&
+	       nla->nla_len >= sizeof(*nla) &&
+	       nla->nla_len <= remaining;
+}
+
+static inline struct nlattr *nla_next(const struct nlattr *nla, int *remaining)
+{
+	int totlen = NLA_ALIGN(nla->nla_len);
+
+	*remaining -= totlen;
+	return (struct nlattr *) ((char *) nla + totlen);
+}
+
+#define nla_for_each_attr(pos, head, len, rem)				\
+	for (pos = head, rem = len;					\
+	     nla_ok(pos, rem);						\
+	     pos = nla_next(pos, &(rem)))
+
+#define nla_for_each_nested(pos, nla, rem)				\
+	nla_for_each_attr(pos, nla_data(nla), nla_len(nla), rem)
+
+#endif /* _NLATTR_H */
@@ -24,8 +24,9 @@
 
 #define COMP "nlmon"
 #include "helper.h"
-#include "hash.h"
-#include "bitmap.h"
+#include "table.h"
+#include "arena.h"
+#include "query.h"
 #include "nlmon.h"
 
 #ifdef DEBUG_ENABLED
@@ -33,172 +34,142 @@ FILE *logfile;
 #endif
 
 static int opt_realtime;
+static int opt_event_loop;
+static int opt_pin = -1;
 
 /* default intervall is one second */
 struct timespec target = { 1, 0 };
 
-/* sync intervall is one second */
-struct timespec ts_sync = { 1, 0 };
 
-/* Generic macros for dealing with netlink sockets */
-#define GENLMSG_DATA(glh)       ((void *)(NLMSG_DATA(glh) + GENL_HDRLEN))
-#define GENLMSG_PAYLOAD(glh)    (NLMSG_PAYLOAD(glh, 0) - GENL_HDRLEN)
-#define NLA_DATA(na)            ((void *)((char*)(na) + NLA_HDRLEN))
-#define NLA_PAYLOAD(len)        (len - NLA_HDRLEN)
+/* cycles end on absolute deadlines, optionally aligned to the wall clock */
+static int opt_align;
+static clockid_t cycle_clock = CLOCK_MONOTONIC;
+static unsigned long long next_deadline;
 
-static int nl_fd;
-static int nl_id;
-static char *nl_cpumask;
+/* output timestamps are relative to the startup */
+static struct timespec ts_start;
 
-static int current_query;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
-extern struct output_operations oops_stdout;
-extern struct output_operations oops_csv;
-extern struct output_operations oops_ncurses;
-extern struct output_operations oops_nop;
-
-enum sort_options opt_sort = OPT_SORT_TIME;
+static int opt_window = QUERY_WINDOW_DEFAULT;
 
-/* Maximum size of response requested or message sent */
-#define MAX_MSG_SIZE    1024
-
-struct msgtemplate {
-	struct nlmsghdr n;
-	struct genlmsghdr g;
-	char buf[MAX_MSG_SIZE];
+/*
+ * The pid space is split into one contiguous shard per worker, each with its
+ * own taskstats socket. Shard 0 is swept by the main thread. Replies are
+ * collected per shard and merged after all workers are done.
+ */
+struct sweep_shard {
+	int first;			/* pid range [first, last) */
+	int last;
+	int next;			/* sweep position, wraps around */
+	int start;			/* position the current cycle started at */
+	int wrapped;			/* passed the end of the range */
+	int visited;			/* tasks handled in this cycle */
+	int partial;			/* ran out of time budget */
+	struct query_sock qs;
+	struct taskstat_delta *deltas;	/* replies of the current cycle */
+	struct arena arena;		/* holds the deltas until the output is done */
+	unsigned long skipped;		/* idle threads not queried */
+	pthread_t thread;
 };
 
-static int send_cmd(int sd, __u16 nlmsg_type, __u32 nlmsg_pid,
-	     __u8 genl_cmd, __u16 nla_type,
-	     void *nla_data, int nla_len)
-{
-	struct nlattr *na;
-	struct sockaddr_nl nladdr;
-	int r, buflen;
-	char *buf;
-
-	struct msgtemplate msg;
-
-	msg.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
-	msg.n.nlmsg_type = nlmsg_type;
-	msg.n.nlmsg_flags = NLM_F_REQUEST;
-	msg.n.nlmsg_seq = 0;
-	msg.n.nlmsg_pid = nlmsg_pid;
-	msg.g.cmd = genl_cmd;
-	msg.g.version = 0x1;
-	na = (struct nlattr *) GENLMSG_DATA(&msg);
-	na->nla_type = nla_type;
-	na->nla_len = nla_len + 1 + NLA_HDRLEN;
-	memcpy(NLA_DATA(na), nla_data, nla_len);
-	msg.n.nlmsg_len += NLMSG_ALIGN(na->nla_len);
-
-	buf = (char *) &msg;
-	buflen = msg.n.nlmsg_len ;
-	memset(&nladdr, 0, sizeof(nladdr));
-	nladdr.nl_family = AF_NETLINK;
-	while ((r = sendto(sd, buf, buflen, 0, (struct sockaddr *) &nladdr,
-			   sizeof(nladdr))) < buflen) {
-		if (r > 0) {
-			buf += r;
-			buflen -= r;
-		} else if (errno != EAGAIN)
-			return -1;
-	}
-	return 0;
-}
+#define MAX_WORKERS	256
 
-static int get_family_id(int sd)
-{
-	struct {
-		struct nlmsghdr n;
-		struct genlmsghdr g;
-		char buf[256];
-	} ans;
+static struct sweep_shard *shards;
+static int opt_workers = 1;
+static pthread_barrier_t sweep_start, sweep_done;
 
-	char name[100];
-	int id = 0, rc;
-	struct nlattr *na;
-	int rep_len;
+/* percentage of the interval the sweep may take, 0 is unlimited */
+static int opt_budget;
+static unsigned long long sweep_budget_end;	/* CLOCK_MONOTONIC ns, 0 is unlimited */
+static int sweep_partial;
+static unsigned long sweep_contended;	/* table lock waits before the sweep */
 
-	memset(name, 0, 100);
-	strcpy(name, TASKSTATS_GENL_NAME);
-	rc = send_cmd(sd, GENL_ID_CTRL, getpid(), CTRL_CMD_GETFAMILY,
-			CTRL_ATTR_FAMILY_NAME, (void *)name,
-			strlen(TASKSTATS_GENL_NAME)+1);
-	if (rc < 0)
-		return 0;	/* sendto() failure? */
+/* processes with more threads are queried per tgid, -1 disables */
+int opt_collapse = -1;
 
-	rep_len = recv(sd, &ans, sizeof(ans), 0);
-	if (ans.n.nlmsg_type == NLMSG_ERROR ||
-	    (rep_len < 0) || !NLMSG_OK((&ans.n), rep_len))
-		return 0;
+/* only the best rows by the sort key are kept, 0 keeps all */
+int opt_top;
 
-	na = (struct nlattr *) GENLMSG_DATA(&ans);
-	na = (struct nlattr *) ((char *) na + NLA_ALIGN(na->nla_len));
-	if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
-		id = *(__u16 *) NLA_DATA(na);
-	}
-	return id;
-}
+#define PID_MAX_DEFAULT	32768
 
-static int setup_netlink(void)
+int pid_max = PID_MAX_DEFAULT;
+
+/* sizes the task table and the pid ranges, pid_max is not changed later on */
+static void read_pid_max(void)
 {
-	int rc, id, rcvbufsz = 0;
-	struct sockaddr_nl nla;
-	socklen_t len;
+	FILE *fp;
+	int val;
 
-	nl_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
-	if (nl_fd < 0)
-		DIE_PERROR("netlink socket failed");
+	fp = fopen("/proc/sys/kernel/pid_max", "r");
+	if (!fp)
+		return;
+	if (fscanf(fp, "%d", &val) == 1 && val > 0)
+		pid_max = val;
+	fclose(fp);
+}
 
-	memset(&nla, 0, sizeof(nla));
-	nla.nl_family = AF_NETLINK;
+/* idle threads are queried at most every nth cycle, 1 disables */
+static int opt_idle_interval = 8;
 
-	rc = bind(nl_fd, (struct sockaddr *) &nla, sizeof(struct sockaddr_nl));
-	if (rc < 0)
-		DIE_PERROR("netlink bind failed");
+/* idle queries before a thread backs off, the counter saturates */
+#define IDLE_HOT	2
+#define IDLE_MAX	16
 
-	len = sizeof(int);
-	if (getsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &rcvbufsz, &len) < 0)
-		fprintf(stderr, "Unable to get socket rcv buf size\n");
-	else
-		DEBUG("receive buffer size: %d\n", rcvbufsz);
+/* moves between cgroups are picked up every few cycles */
+#define CGROUP_RESCAN_CYCLES	5
 
-	id = get_family_id(nl_fd);
-	if (!id)
-		DIE_PERROR("Error getting family id");
+extern struct output_operations oops_stdout;
+extern struct output_operations oops_csv;
+extern struct output_operations oops_ncurses;
+extern struct output_operations oops_nop;
 
-	nl_id = id;
-	DEBUG("family id %d\n", nl_id);
-	return 0;
+enum sort_options opt_sort = OPT_SORT_TIME;
+
+/* the kernel derives btime from the current time, it jitters by a second */
+static int btime_changed(struct task_entry *h, struct taskstats *t)
+{
+	if (!h->btime || !t->ac_btime)
+		return 0;
+	return h->btime > t->ac_btime + 1 || t->ac_btime > h->btime + 1;
 }
 
-static void handle_async_event(struct taskstats *t, int pid)
+/* exec of a non-leader thread hands the counters of another task to the tid */
+static int counters_backwards(struct task_entry *h, struct taskstats *t)
 {
-	fprintf(stderr, "Exit record for PID: %5d [%s]  exitcode: %d\n",
-		pid,
-		t->ac_comm,
-		t->ac_exitcode
-		);
-	fprintf(stderr, "utime: %llu  stime: %llu\n", t->ac_utime, t->ac_stime);
+	return  h->utime > t->ac_utime ||
+		h->stime > t->ac_stime ||
+		h->io_rd_bytes > t->read_char ||
+		h->io_wr_bytes > t->write_char ||
+		h->blkio_delay > t->blkio_delay_total ||
+		h->cpu_delay > t->cpu_delay_total;
+}
 
+/*
+ * A step of the wall clock moves the btime of every task, only a task whose
+ * counters went backwards as well is a new one.
+ */
+static int tid_reused(struct task_entry *h, struct taskstats *t)
+{
+	if (!btime_changed(h, t))
+		return 0;
+	if (counters_backwards(h, t))
+		return 1;
+	h->btime = t->ac_btime;
+	return 0;
 }
 
-static void __gather_data_sanity(struct hash_entry *h, struct taskstats *t)
+static const struct taskstats zero_stats;
+
+static void set_baseline(struct task_entry *h, const struct taskstats *t)
 {
-	// stupid missing memset, can be removed later
-	if (h->utime > t->ac_utime)
-		DIE("invalid utime  value old: %llu  new: %llu\n", h->utime, t->ac_utime);
-	if (h->stime > t->ac_stime)
-		DIE("invalid stime  value old: %llu  new: %llu\n", h->stime, t->ac_stime);
-	if (h->io_rd_bytes > t->read_char)
-		DIE("invalid io read value old: %llu  new: %llu\n", h->io_rd_bytes, (unsigned long long) t->read_char);
-	if (h->io_wr_bytes > t->write_char)
-		DIE("invalid io write value old: %llu  new: %llu\n", h->io_wr_bytes, (unsigned long long) t->write_char);
-	if (h->blkio_delay > t->blkio_delay_total)
-		DIE("invalid blkio delay total value old: %llu  new: %llu\n", h->blkio_delay, t->blkio_delay_total);
-	if (h->cpu_delay > t->cpu_delay_total)
-		DIE("invalid cpu delay total value old: %llu  new: %llu\n", h->cpu_delay, t->cpu_delay_total);
+	h->utime = t->ac_utime;
+	h->stime = t->ac_stime;
+	h->cpu_delay = t->cpu_delay_total;
+	h->rss = t->coremem;
+	h->io_rd_bytes = t->read_char;
+	h->io_wr_bytes = t->write_char;
+	h->blkio_delay = t->blkio_delay_total;
 }
 
 static int output_wanted(struct taskstat_delta *delta)
@@ -214,33 +185,24 @@ static int output_wanted(struct taskstat_delta *delta)
 
 static int once;
 
-static void gather_data(struct taskstats *t)
+/*
+ * Delta against the baseline of the task, the baseline gets updated. A new
+ * task behind a recycled tid starts from zero, if the counters went
+ * backwards otherwise the delta is lost and the baseline starts over.
+ */
+void calc_delta(struct task_entry *h, struct taskstats *t, struct taskstat_delta *delta)
 {
-	struct taskstat_delta *delta;
-	struct hash_entry *h;
-
-	if (!nr_cycles && !once) {
-		ts_version = t->version;
-		ts_size = sizeof(*t);
-		output->print_banner(t);
-		once = 1;
+	if (tid_reused(h, t)) {
+		DEBUG("tid %d was reused\n", t->ac_pid);
+		set_baseline(h, &zero_stats);
+		h->btime = 0;
+		h->comm[0] = 0;
+	} else if (counters_backwards(h, t)) {
+		DEBUG("counters of tid %d went backwards\n", t->ac_pid);
+		set_baseline(h, t);
 	}
-
-	h = get_hash_entry(t->ac_pid);
-	if (!h)
-		DIE("hash entry missing for process %d!", t->ac_pid);
-	if (t->ac_pid != h->tid)
-		DIE("pid mismatch in hash!");
-
-	// XXX this sucks, optimize later
-	delta = malloc(sizeof(struct taskstat_delta));
-	if (!delta)
-		DIE_PERROR("malloc failed");
-	memset(delta, 0, sizeof(struct taskstat_delta));
-	delta->pid = h->tgid;
-	delta->tid = t->ac_pid;
-
-	__gather_data_sanity(h, t);
+	if (!h->btime)
+		h->btime = t->ac_btime;
 
 	delta->utime = t->ac_utime - h->utime;
 	delta->stime = t->ac_stime - h->stime;
@@ -250,127 +212,201 @@ static void gather_data(struct taskstats *t)
 	delta->io_wr_bytes = t->write_char - h->io_wr_bytes;
 	delta->blkio_delay = t->blkio_delay_total - h->blkio_delay;
 
-	/* store new values */
-	h->utime = t->ac_utime;
-	h->stime = t->ac_stime;
-	h->cpu_delay = t->cpu_delay_total;
-	h->rss = t->coremem;
-	h->io_rd_bytes = t->read_char;
-	h->io_wr_bytes = t->write_char;
-	h->blkio_delay = t->blkio_delay_total;
+	set_baseline(h, t);
+}
 
-	put_hash_entry(t->ac_pid);
+/* negative deltas are kept back until the exit record they wait for arrived */
+static unsigned long long proc_counter_delta(unsigned long long *base, unsigned long long now)
+{
+	unsigned long long delta = now - *base;
 
-	if (t->ac_exitcode)
-		DEBUG("exiting task: %d [%s]\n", t->ac_pid, t->ac_comm);
+	if ((s64) delta < 0)
+		return 0;
+	*base = now;
+	return delta;
+}
+
+/*
+ * Tgid queries include the counters of already exited threads so the totals
+ * only grow, the final interval of a dead thread shows up in the next query.
+ */
+void calc_proc_delta(struct task_entry *p, struct taskstats *t, struct taskstat_delta *delta)
+{
+	delta->utime = proc_counter_delta(&p->utime, t->ac_utime);
+	delta->stime = proc_counter_delta(&p->stime, t->ac_stime);
+	delta->cpu_delay = proc_counter_delta(&p->cpu_delay, t->cpu_delay_total);
+	delta->blkio_delay = proc_counter_delta(&p->blkio_delay, t->blkio_delay_total);
+}
 
+/* consumes the delta, comm must be filled in */
+static void account_delta(struct taskstat_delta *delta)
+{
 	current_sum_utime += delta->utime / 1000;
 	current_sum_stime += delta->stime / 1000;
 
-	if (!nr_cycles)
+	/* only output if one value changed! the others go with the arena */
+	if (output_wanted(delta))
+		cache_add(delta);
+}
+
+/* taskstats does not fill in the name for tgid queries */
+void read_comm(int pid, char *comm)
+{
+	char name[32];
+	FILE *fp;
+
+	memset(comm, 0, TS_COMM_LEN);
+	snprintf(name, sizeof(name), "/proc/%d/comm", pid);
+	fp = fopen(name, "r");
+	if (!fp)
 		return;
+	if (fgets(comm, TS_COMM_LEN, fp))
+		comm[strcspn(comm, "\n")] = 0;
+	fclose(fp);
+}
 
-	/* only output if one value changed! */
-	if (output_wanted(delta)) {
-		// XXX optimize later, maybe pointer to task string in hash entry?
-		memcpy(&delta->comm, t->ac_comm, TS_COMM_LEN);
-		cache_add(delta);
-	}
+/* with --top stale process names are read from procfs for the printed rows only, unless sorted by name */
+static int names_deferred(void)
+{
+	return opt_top && opt_sort != OPT_SORT_NAME;
 }
 
-static int query_task(int victim)
+/* baseline replies of the startup scan come without a shard and use the scratch delta */
+static struct taskstat_delta *shard_alloc(struct sweep_shard *shard, struct taskstat_delta *scratch)
 {
-	int cmd_type = TASKSTATS_CMD_ATTR_PID;
-	//int cmd_type = TASKSTATS_CMD_ATTR_TGID;
-	int rc, tid = victim;
+	struct taskstat_delta *delta = scratch;
 
-	current_query = victim;
-	// XXX optimize getpid away
-	rc = send_cmd(nl_fd, nl_id, getpid(), TASKSTATS_CMD_GET,
-		      cmd_type, &tid, sizeof(unsigned int));
-	if (rc < 0) {
-		fprintf(stderr, "error sending tid/tgid cmd\n");
-		return -1;
-	}
-	DEBUG("query: sent pid/tgid %d, retval %d\n", victim, rc);
-	return 0;
+	if (shard)
+		delta = arena_alloc(&shard->arena, sizeof(struct taskstat_delta));
+	memset(delta, 0, sizeof(struct taskstat_delta));
+	return delta;
+}
+
+static void shard_add(struct sweep_shard *shard, struct taskstat_delta *delta)
+{
+	if (!shard)
+		return;
+	delta->next = shard->deltas;
+	shard->deltas = delta;
 }
 
-static void receive_taskstats(void)
+static void gather_proc_data(struct sweep_shard *shard, struct taskstats *t, int tgid)
 {
-	int rep_len, len2, aggr_len;
-	int len = 0, count = 0, resolved = 0;
-	struct msgtemplate msg;
-	struct nlattr *na;
-	pid_t rtid = 0;
+	struct taskstat_delta scratch, *delta;
+	struct task_entry *p;
+	char comm[TS_COMM_LEN];
+	int stale;
 
-	do {
-		DEBUG("record: %d  ", count);
-		rep_len = recv(nl_fd, &msg, sizeof(msg), 0);
+	p = get_proc_entry(tgid);
+	if (!p)
+		return;
 
-		if (rep_len < 0) {
-			fprintf(stderr, "nonfatal reply error: errno %d\n", errno);
-			continue;
-		}
-		if (msg.n.nlmsg_type == NLMSG_ERROR || !NLMSG_OK((&msg.n), rep_len)) {
-			struct nlmsgerr *err = NLMSG_DATA(&msg);
-			fprintf(stderr, "fatal reply error,  errno %d\n", err->error);
-			return;
-		}
+	delta = shard_alloc(shard, &scratch);
 
-		DEBUG("nlmsghdr size=%zu, nlmsg_len=%d, rep_len=%d\n",
-			sizeof(struct nlmsghdr), msg.n.nlmsg_len, rep_len);
-
-		rep_len = GENLMSG_PAYLOAD(&msg.n);
-		na = (struct nlattr *) GENLMSG_DATA(&msg);
-		len = 0;
-		while (len < rep_len) {
-			len += NLA_ALIGN(na->nla_len);
-			switch (na->nla_type) {
-			case TASKSTATS_TYPE_NULL:
-				break;
-			case TASKSTATS_TYPE_AGGR_TGID:
-			case TASKSTATS_TYPE_AGGR_PID:
-				aggr_len = NLA_PAYLOAD(na->nla_len);
-				len2 = 0;
-				/* For nested attributes, na follows */
-				na = (struct nlattr *) NLA_DATA(na);
-				while (len2 < aggr_len) {
-					switch (na->nla_type) {
-					case TASKSTATS_TYPE_PID:
-						rtid = *(int *) NLA_DATA(na);
-						if (rtid == current_query)
-							resolved = 1;
-						DEBUG("receive: rtid PID\t%d\n", rtid);
-						break;
-					case TASKSTATS_TYPE_TGID:
-						rtid = *(int *) NLA_DATA(na);
-						if (rtid == current_query)
-							resolved = 1;
-						fprintf(stderr, "rtid TGID\t%d\n", rtid);
-						break;
-					case TASKSTATS_TYPE_STATS:
-						count++;
-						if (rtid == current_query)
-							gather_data((struct taskstats *) NLA_DATA(na));
-						else
-							handle_async_event((struct taskstats *) NLA_DATA(na), rtid);
-						break;
-					default:
-						fprintf(stderr, "Unknown nested nla_type %d\n",
-							na->nla_type);
-						break;
-					}
-					len2 += NLA_ALIGN(na->nla_len);
-					na = (struct nlattr *) ((char *) na + len2);
-				}
-				break;
-			default:
-				fprintf(stderr, "Unknown nla_type %d\n", na->nla_type);
-			}
-			na = (struct nlattr *) (GENLMSG_DATA(&msg) + len);
+	/* the first query only establishes the baseline */
+	if (!p->have_baseline) {
+		calc_proc_delta(p, t, delta);
+		p->have_baseline = 1;
+		delta = NULL;
+	} else {
+		delta->pid = tgid;
+		delta->tid = tgid;
+		delta->nr_threads = max(p->nr_threads, 1);
+		calc_proc_delta(p, t, delta);
+		memcpy(&delta->comm, p->comm, TS_COMM_LEN);
+	}
+	stale = !p->comm[0] && !names_deferred();
+	put_task_entry(tgid);
+
+	/* the name is unknown after an exec, read it outside of the lock */
+	if (stale) {
+		read_comm(tgid, comm);
+		p = get_proc_entry(tgid);
+		if (p) {
+			if (!p->comm[0])
+				memcpy(p->comm, comm, TS_COMM_LEN);
+			put_task_entry(tgid);
 		}
-	} while (!resolved);
+		if (delta)
+			memcpy(&delta->comm, comm, TS_COMM_LEN);
+	}
+	if (delta)
+		shard_add(shard, delta);
+}
+
+static void gather_data(struct taskstats *t, int id, int type, void *priv)
+{
+	struct sweep_shard *shard = priv;
+	struct taskstat_delta scratch, *delta;
+	struct task_entry *h;
+
+	/* the first reply tells the version for the banner */
+	if (!once && __sync_bool_compare_and_swap(&once, 0, 1)) {
+		ts_version = t->version;
+		ts_size = sizeof(*t);
+	}
+
+	if (type == TASKSTATS_CMD_ATTR_TGID) {
+		gather_proc_data(shard, t, id);
+		return;
+	}
+
+	/* the exit record of the task may have been accounted meanwhile */
+	h = get_task_entry(t->ac_pid);
+	if (!h) {
+		DEBUG("reply for %d after it was removed\n", t->ac_pid);
+		return;
+	}
+	if (t->ac_pid != h->tid)
+		DIE("pid mismatch in task table!");
+
+	delta = shard_alloc(shard, &scratch);
+	delta->pid = h->tgid;
+	delta->tid = t->ac_pid;
+
+	/* the usage before a task moved into the cgroups is not reported */
+	if (h->moved_in) {
+		set_baseline(h, t);
+		h->moved_in = 0;
+	}
+	calc_delta(h, t, delta);
+	if (hf_enabled())
+		hf_watch(t);
+
+	/* any activity promotes the thread back to be queried every cycle */
+	if (output_wanted(delta))
+		h->idle = 0;
+	else if (h->idle < IDLE_MAX)
+		h->idle++;
+
+	/* the name is cached until a comm or exec event invalidates it */
+	if (!h->comm[0])
+		memcpy(h->comm, t->ac_comm, TS_COMM_LEN);
+	memcpy(&delta->comm, h->comm, TS_COMM_LEN);
+	put_task_entry(t->ac_pid);
+
+	if (t->ac_exitcode)
+		DEBUG("exiting task: %d [%s]\n", t->ac_pid, t->ac_comm);
+
+	shard_add(shard, delta);
+}
+
+/* tasks that died in this cycle are accounted with their exit record */
+static void gather_exited(void)
+{
+	struct taskstat_delta *delta, *next;
+	int reaped;
+
+	for (delta = collect_exit_records(); delta; delta = next) {
+		next = delta->next;
+		account_delta(delta);
+		/* nothing follows the exit record */
+		cache_forget(delta->tid);
+	}
+
+	reaped = reap_task_entries(nr_cycles);
+	if (reaped)
+		DEBUG("reaped %d tasks without exit record\n", reaped);
 }
 
 static void timespec_delta(const struct timespec *start, const struct timespec *end, struct timespec *res)
@@ -384,31 +420,399 @@ static void timespec_delta(const struct timespec *start, const struct timespec *
 	}
 }
 
-static void query_tasks(void)
+void elapsed_time(const struct timespec *now, struct timespec *res)
+{
+	timespec_delta(&ts_start, now, res);
+}
+
+/*
+ * Returns the tgid if the thread belongs to a collapsed process that was not
+ * queried in this cycle, -1 if it was queried already and 0 if the thread
+ * needs to be queried on its own.
+ */
+static int collapsed_tgid(int tid)
+{
+	struct task_entry *h, *p;
+	int tgid, rc = 0;
+
+	h = get_task_entry(tid);
+	if (!h)
+		return 0;
+	tgid = h->tgid;
+	put_task_entry(tid);
+
+	p = get_proc_entry(tgid);
+	if (!p)
+		return 0;
+
+	/* sticky, thread baselines are not maintained for collapsed processes */
+	if (p->nr_threads > opt_collapse)
+		p->collapsed = 1;
+	if (p->collapsed) {
+		rc = (p->queried_cycle == nr_cycles) ? -1 : tgid;
+		p->queried_cycle = nr_cycles;
+	}
+	put_task_entry(tgid);
+	return rc;
+}
+
+/*
+ * Threads without activity back off exponentially up to the idle interval.
+ * Their delta accumulates in the kernel until they are queried again. The
+ * tid spreads the threads of one tier over the cycles.
+ */
+static int query_due(int tid)
+{
+	struct task_entry *h;
+	int interval = 1;
+
+	h = get_task_entry(tid);
+	if (!h)
+		return 1;
+	if (h->idle >= IDLE_HOT)
+		interval = min(1 << (h->idle - IDLE_HOT + 1), opt_idle_interval);
+	put_task_entry(tid);
+
+	return (nr_cycles + tid) % interval == 0;
+}
+
+/* returns 1 if a request had to be sent */
+static int submit_task(struct sweep_shard *shard, int pid)
+{
+	int tgid;
+
+	if (opt_collapse >= 0) {
+		tgid = collapsed_tgid(pid);
+		if (tgid > 0)
+			query_submit(&shard->qs, tgid, TASKSTATS_CMD_ATTR_TGID);
+		if (tgid)
+			return tgid > 0;
+	}
+	if (opt_idle_interval > 1 && !query_due(pid)) {
+		shard->skipped++;
+		return 0;
+	}
+	query_submit(&shard->qs, pid, TASKSTATS_CMD_ATTR_PID);
+	return 1;
+}
+
+static void shard_begin(struct sweep_shard *shard)
+{
+	if (shard->next < shard->first || shard->next >= shard->last)
+		shard->next = shard->first;
+	shard->start = shard->next;
+	shard->wrapped = 0;
+	shard->visited = 0;
+	shard->partial = 0;
+}
+
+/*
+ * Next tracked pid of the shard, the range is walked once from the start
+ * position to the end and from the beginning up to the start position.
+ * Returns -1 once the shard is done.
+ */
+static int shard_next_pid(struct sweep_shard *shard)
 {
 	int pid;
 
-	for (pid = 0; pid < PID_MAX; pid++)
-		if (bm_test(pid)) {
-			query_task(pid);
-			receive_taskstats();
+	for (;;) {
+		pid = task_next(shard->next);
+		if (pid < 0)
+			pid = pid_max;
+		if (shard->wrapped && pid >= shard->start)
+			return -1;
+		if (pid < shard->last) {
+			shard->next = pid + 1;
+			return pid;
 		}
+		shard->wrapped = 1;
+		shard->next = shard->first;
+	}
 }
 
-void wait_for_cycle_end(struct timespec *sleep)
+static int budget_exhausted(void)
 {
-	struct timespec remain;
-	int rc;
+	struct timespec now;
+
+	if (!sweep_budget_end)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec >= sweep_budget_end;
+}
+
+/*
+ * Submits requests until the shard is done or the time budget is exhausted.
+ * The next cycle resumes at the same position, skipped tasks keep their
+ * baseline so their delta is complete when they are caught up. Without
+ * blocking it also returns once all slots are busy. Returns 1 if done.
+ */
+static int shard_step(struct sweep_shard *shard, int nonblock)
+{
+	int pid;
+
+	for (;;) {
+		if (nonblock && !shard->qs.nr_free)
+			return 0;
+		/* checking the clock for every task would be too expensive */
+		if (!(shard->visited & 63) && budget_exhausted()) {
+			shard->partial = 1;
+			return 1;
+		}
+
+		pid = shard_next_pid(shard);
+		if (pid < 0)
+			return 1;
+		shard->visited++;
+		submit_task(shard, pid);
+	}
+}
+
+static void query_shard(struct sweep_shard *shard)
+{
+	shard_begin(shard);
+	shard_step(shard, 0);
+	query_drain(&shard->qs);
+}
 
-resume:
-	rc = nanosleep(sleep, &remain);
-	if (rc < 0 && errno == EINTR) {
-		fprintf(stderr, "resuming interrupted sleep\n");
-		*sleep = remain;
-		goto resume;
+/* non-blocking variant for the event loop */
+void sweep_begin(void)
+{
+	shard_begin(&shards[0]);
+}
+
+/* returns 1 once all requests were submitted */
+int sweep_step(void)
+{
+	int done;
+
+	done = shard_step(&shards[0], 1);
+	query_flush(&shards[0].qs);
+	return done;
+}
+
+struct query_sock *sweep_socket(void)
+{
+	return &shards[0].qs;
+}
+
+static void *sweep_worker_main(void *arg)
+{
+	struct sweep_shard *shard = arg;
+
+	/* endless loop */
+	for (;;) {
+		pthread_barrier_wait(&sweep_start);
+		query_shard(shard);
+		pthread_barrier_wait(&sweep_done);
+	}
+	return NULL;
+}
+
+/* split the pid space so that every shard gets about the same number of tasks */
+static void partition_shards(void)
+{
+	int pid, i = 1, seen = 0;
+	int tasks = max(atomic_read(&nr_threads), 1);
+
+	shards[0].first = 0;
+	for (pid = task_next(0); pid >= 0 && i < opt_workers; pid = task_next(pid + 1)) {
+		if (seen++ >= i * tasks / opt_workers) {
+			shards[i - 1].last = pid;
+			shards[i].first = pid;
+			i++;
+		}
+	}
+	/* not enough tasks, the remaining shards stay empty */
+	for (; i < opt_workers; i++) {
+		shards[i - 1].last = pid_max;
+		shards[i].first = pid_max;
+	}
+	shards[opt_workers - 1].last = pid_max;
+}
+
+/*
+ * Deltas are accounted in shard order, the cache breaks ties by tid so the
+ * output does not depend on which worker finished first.
+ */
+static void merge_shards(void)
+{
+	struct taskstat_delta *delta, *next;
+	int i;
+
+	for (i = 0; i < opt_workers; i++) {
+		for (delta = shards[i].deltas; delta; delta = next) {
+			next = delta->next;
+			account_delta(delta);
+		}
+		shards[i].deltas = NULL;
+	}
+}
+
+static void query_tasks(void)
+{
+	if (opt_workers > 1) {
+		/* keep the shards until every shard caught up */
+		if (!sweep_partial)
+			partition_shards();
+		pthread_barrier_wait(&sweep_start);
+	}
+	query_shard(&shards[0]);
+	if (opt_workers > 1)
+		pthread_barrier_wait(&sweep_done);
+}
+
+/* a thread that is gone without an exit event was missed by the connector */
+static void sweep_error(int id, int type, int error, void *unused)
+{
+	if (error != -ESRCH)
+		fprintf(stderr, "reply error for %d, errno %d\n", id, error);
+	else if (type == TASKSTATS_CMD_ATTR_PID)
+		proc_task_gone(id);
+}
+
+/* socket for the baseline queries of the startup scan */
+void baseline_open(struct query_sock *qs)
+{
+	query_open(qs, opt_window);
+	qs->handler = gather_data;
+	qs->error_handler = sweep_error;
+	qs->priv = NULL;
+}
+
+static void start_workers(void)
+{
+	int i, rc;
+
+	shards = calloc(opt_workers, sizeof(struct sweep_shard));
+	if (!shards)
+		DIE_PERROR("calloc failed");
+	shards[0].last = pid_max;
+
+	for (i = 0; i < opt_workers; i++) {
+		query_open(&shards[i].qs, opt_window);
+		shards[i].qs.handler = gather_data;
+		shards[i].qs.error_handler = sweep_error;
+		shards[i].qs.priv = &shards[i];
+		arena_init(&shards[i].arena, DELTA_ARENA_CHUNK);
+	}
+	if (opt_workers == 1)
+		return;
+
+	if (pthread_barrier_init(&sweep_start, NULL, opt_workers) ||
+	    pthread_barrier_init(&sweep_done, NULL, opt_workers))
+		DIE_PERROR("pthread_barrier_init failed");
+
+	for (i = 1; i < opt_workers; i++) {
+		char name[24];
+
+		rc = pthread_create(&shards[i].thread, NULL, sweep_worker_main, &shards[i]);
+		if (rc)
+			DIE_PERROR("pthread_create failed");
+		snprintf(name, sizeof(name), "nlmon-sweep%d", i);
+		pthread_setname_np(shards[i].thread, name);
 	}
+}
+
+static void stop_workers(void)
+{
+	int i;
+
+	/* workers are parked at the start barrier, nothing to join */
+	for (i = 0; i < opt_workers; i++) {
+		DEBUG("shard %d: idle threads skipped: %lu\n", i, shards[i].skipped);
+		query_close(&shards[i].qs);
+	}
+}
+
+static unsigned long long timespec_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void ns_to_timespec(unsigned long long ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static unsigned long long cycle_clock_ns(void)
+{
+	struct timespec now;
+	int rc;
+
+	rc = clock_gettime(cycle_clock, &now);
 	if (rc < 0)
-		DIE_PERROR("nanosleep failed");
+		DIE_PERROR("clock_gettime failed");
+	return timespec_to_ns(&now);
+}
+
+/* the first cycle ends one interval after the scan or on the next boundary */
+static void init_deadline(void)
+{
+	unsigned long long interval = timespec_to_ns(&target);
+
+	next_deadline = cycle_clock_ns() + interval;
+	if (opt_align)
+		next_deadline = next_deadline / interval * interval;
+}
+
+/*
+ * Deadlines are absolute so the cycles do not drift. If a cycle overran the
+ * missed intervals are skipped and merged into the next cycle.
+ */
+static void advance_deadline(void)
+{
+	unsigned long long interval = timespec_to_ns(&target);
+	unsigned long long now = cycle_clock_ns();
+
+	next_deadline += interval;
+	if (next_deadline > now)
+		return;
+
+	while (next_deadline <= now) {
+		next_deadline += interval;
+		nr_overruns++;
+	}
+	DEBUG("cycle %d overran, total missed intervals: %d\n", nr_cycles, nr_overruns);
+}
+
+static void wait_for_deadline(void)
+{
+	struct timespec ts;
+	int rc;
+
+	ns_to_timespec(next_deadline, &ts);
+	while ((rc = clock_nanosleep(cycle_clock, TIMER_ABSTIME, &ts, NULL)) == EINTR)
+		;
+	if (rc)
+		DIE("clock_nanosleep failed with error %d\n", rc);
+}
+
+/* all deltas of the cycle are gone with the output */
+static void reset_arenas(void)
+{
+	int i;
+
+	for (i = 0; i < opt_workers; i++)
+		arena_reset(&shards[i].arena);
+	exit_records_reset();
+}
+
+/* process rows with a stale name are looked up in procfs when printed */
+static void fill_comm(struct taskstat_delta *delta)
+{
+	int id = delta->pid;
+	struct task_entry *h;
+
+	if (delta->comm[0] || !delta->nr_threads)
+		return;
+
+	read_comm(id, delta->comm);
+	if ((h = get_proc_entry(id))) {
+		if (!h->comm[0])
+			memcpy(h->comm, delta->comm, TS_COMM_LEN);
+		put_task_entry(id);
+	}
 }
 
 static void print_tasks(void)
@@ -417,97 +821,114 @@ static void print_tasks(void)
 
 	for (;;) {
 		delta = cache_walk(delta);
-		if (delta)
-			output->print_data(delta);
-		else
+		if (!delta)
 			break;
+		fill_comm(delta);
+		output->print_data(delta);
 	}
 	cache_flush();
+	reset_arenas();
 }
 
-static void measure_one_cycle(void)
+static struct timespec ts_begin;
+
+/* first half of a cycle, the tasks are queried next */
+void cycle_begin(void)
 {
-	struct timespec ts1, ts2, delta, sleep;
-	int rc;
+	unsigned long acquired;
+	int rc, nr;
 
 	current_sum_utime = 0;
 	current_sum_stime = 0;
 	current_sum_cpu_utime = 0;
 	current_sum_cpu_stime = 0;
 
-	if (nr_cycles)
-		output->print_cycle_start();
-	else
-		output->print_sync();
+	/* forks and exits since the last sweep, nothing else changes the tracking */
+	nr = proc_events_apply();
+	if (nr)
+		DEBUG("cycle %d: applied %d events\n", nr_cycles, nr);
+	if (cgroup_scoped() && nr_cycles % CGROUP_RESCAN_CYCLES == 0)
+		proc_events_rescan();
+
 	new_cycle = 1;
 
-	rc = clock_gettime(CLOCK_MONOTONIC, &ts1);
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts_begin);
 	if (rc < 0)
 		DIE_PERROR("clock_gettime failed");
+	elapsed_time(&ts_begin, &ts_cycle);
 
-	query_tasks();
+	table_contention(&acquired, &sweep_contended);
+
+	sweep_budget_end = 0;
+	if (opt_budget)
+		sweep_budget_end = timespec_to_ns(&ts_begin) +
+				   timespec_to_ns(&target) * opt_budget / 100;
+}
+
+/* estimated from the number of tracked tasks if the sweep was partial */
+static void sweep_stats(void)
+{
+	unsigned long acquired, contended;
+	int i, visited = 0;
+
+	/* the sweep should not wait for fork and exit handling */
+	table_contention(&acquired, &contended);
+	if (contended > sweep_contended)
+		DEBUG("cycle %d: %lu contended table locks during the sweep\n",
+			nr_cycles, contended - sweep_contended);
+
+	sweep_partial = 0;
+	for (i = 0; i < opt_workers; i++) {
+		visited += shards[i].visited;
+		sweep_partial |= shards[i].partial;
+	}
+	sweep_coverage = 100;
+	if (sweep_partial)
+		sweep_coverage = min(100, visited * 100 / max(atomic_read(&nr_threads), 1));
+}
+
+/* second half of a cycle after all replies arrived, sets the next deadline */
+void cycle_end(void)
+{
+	struct timespec ts, delta;
+	int rc;
+
+	merge_shards();
+	sweep_stats();
+	gather_exited();
 	query_memory();
 	query_cpus(opt_all_cpus);
 
+	/* samples may show up between the cycles but not within */
+	pthread_mutex_lock(&output_lock);
+	output->print_cycle_start();
 	print_tasks();
 	print_memory();
 	print_cpus(opt_all_cpus);
 
-	rc = clock_gettime(CLOCK_MONOTONIC, &ts2);
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (rc < 0)
 		DIE_PERROR("clock_gettime failed");
 
-	timespec_delta(&ts1, &ts2, &delta);
-	if (nr_cycles)
-		output->print_cycle_end(&delta);
-
-	/* check if we can meet the target measurement interval */
-	if (delta.tv_sec > target.tv_sec ||
-	    (delta.tv_sec == target.tv_sec && delta.tv_nsec > target.tv_nsec)) {
-		output->exit_output();
-		DIE("Target measurement intervall too small. Current overhead: %u seconds %lu ms\n",
-			(int) delta.tv_sec, delta.tv_nsec / NSECS_PER_MSEC);
-	}
-
-	/* now go sleeping for the rest of the measurement interval */
-	if (nr_cycles)
-		timespec_delta(&delta, &target, &sleep);
-	else
-		timespec_delta(&delta, &ts_sync, &sleep);
-
-	wait_for_cycle_end(&sleep);
-	nr_cycles++;
+	timespec_delta(&ts_begin, &ts, &delta);
+	advance_deadline();
+	output->print_cycle_end(&delta);
+	pthread_mutex_unlock(&output_lock);
 }
 
-static void setup_cpumask(void)
+void cycle_deadline(clockid_t *clock, struct timespec *ts)
 {
-	nl_cpumask = malloc(20);	/* enough for "0-4096" :) */
-	if (nl_cpumask < 0)
-		DIE_PERROR("malloc failed");
-	memset(nl_cpumask, 0, 20);
-	snprintf(nl_cpumask, 20, "0-%d", nr_cpus - 1);
+	*clock = cycle_clock;
+	ns_to_timespec(next_deadline, ts);
 }
 
-static void start_task_monitor(void)
-{
-	int rc;
-
-	setup_cpumask();
-	DEBUG("Starting task life cycle monitor on CPUs %s\n", nl_cpumask);
-
-	rc = send_cmd(nl_fd, nl_id,
-		      getpid(),
-		      TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK,
-		      nl_cpumask, strlen(nl_cpumask) + 1);
-	if (rc < 0)
-		DIE("send cmd failed with error %d\n", rc);
-}
-
-static void stop_task_monitor(void)
+static void measure_one_cycle(void)
 {
-	send_cmd(nl_fd, nl_id, getpid(), TASKSTATS_CMD_GET,
-		 TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK,
-		 nl_cpumask, strlen(nl_cpumask) + 1);
+	wait_for_deadline();
+	cycle_begin();
+	query_tasks();
+	cycle_end();
+	nr_cycles++;
 }
 
 /* elevate to maximum realtime priority :) */
@@ -546,12 +967,45 @@ static void print_help(int argc, char* argv[])
 	fprintf(stderr, "  -o <mode> or --output <mode>\n");
 	fprintf(stderr, "      Modes: stdout, csv, ncurses\n");
 	fprintf(stderr, "  -s <mode> or --sort <mode>\n");
-	fprintf(stderr, "      Modes: id, name, time, io, mem\n");
+	fprintf(stderr, "      Modes: id, name, time, io, mem, delay, iodelay\n");
 	fprintf(stderr, "  --realtime\n");
 	fprintf(stderr, "  --all_cpus\n");
 	fprintf(stderr, "  --seconds <seconds>\n");
 	fprintf(stderr, "  --milliseconds <milliseconds>\n");
 	fprintf(stderr, "  -c <cycles> or --cycles <cycles>\n");
+	fprintf(stderr, "  --event-loop\n");
+	fprintf(stderr, "      Run connector, queries and timer in one thread\n");
+	fprintf(stderr, "  --pin <cpu>\n");
+	fprintf(stderr, "      Run the monitor on one cpu\n");
+	fprintf(stderr, "  --align\n");
+	fprintf(stderr, "      Start the cycles on multiples of the interval in wall clock time\n");
+	fprintf(stderr, "  --window <requests>\n");
+	fprintf(stderr, "      Taskstats requests in flight, default %d\n", QUERY_WINDOW_DEFAULT);
+	fprintf(stderr, "  --budget <percent>\n");
+	fprintf(stderr, "      Limit the sweep to a share of the interval, resume in the next cycle\n");
+	fprintf(stderr, "  --workers <threads>\n");
+	fprintf(stderr, "      Sweep the tasks in parallel shards, default 1\n");
+	fprintf(stderr, "  --idle-interval <cycles>\n");
+	fprintf(stderr, "      Query idle threads at most every nth cycle, default 8, 1 disables\n");
+	fprintf(stderr, "  --pids <pids>\n");
+	fprintf(stderr, "      Comma separated pids, only monitor these processes and their threads\n");
+	fprintf(stderr, "  --cgroup <path>\n");
+	fprintf(stderr, "      Only monitor tasks in this cgroup v2 subtree, may be repeated\n");
+	fprintf(stderr, "  --sample <pids>\n");
+	fprintf(stderr, "      Comma separated pids or tids to sample at a high frequency\n");
+	fprintf(stderr, "  --sample-comm <pattern>\n");
+	fprintf(stderr, "      Sample threads with a matching name at a high frequency\n");
+	fprintf(stderr, "  --sample-interval <milliseconds>\n");
+	fprintf(stderr, "      Sampling interval, default 20\n");
+	fprintf(stderr, "      Sampling can not be combined with --per-process or --collapse\n");
+	fprintf(stderr, "  --per-process\n");
+	fprintf(stderr, "      Query and report processes instead of threads\n");
+	fprintf(stderr, "  --collapse <threads>\n");
+	fprintf(stderr, "      Report processes with more threads as one row\n");
+	fprintf(stderr, "  --top <rows>\n");
+	fprintf(stderr, "      Only keep the best rows by the sort key in each cycle\n");
+	fprintf(stderr, "  --exit-shards <sockets>\n");
+	fprintf(stderr, "      Split exit record listening over CPU subsets\n");
 	fprintf(stderr, "  -h or --help\n");
 	exit(EXIT_FAILURE);
 }
@@ -559,8 +1013,10 @@ static void print_help(int argc, char* argv[])
 int main(int argc, char* argv[])
 {
 	pthread_t proc_events_thread;
+	int rc, opt, nl_fd = -1, cycles = INT_MAX;
+	struct timespec ts;
+	sigset_t sigmask;
 	void *status;
-	int rc, opt, cycles = INT_MAX;
 
 #ifdef DEBUG_ENABLED
 	logfile = fopen(DEBUG_LOGFILE, "w");
@@ -568,6 +1024,8 @@ int main(int argc, char* argv[])
 		DIE_PERROR("Cannot open file " DEBUG_LOGFILE " for writing");
 #endif
 
+	read_pid_max();
+
 #ifdef CONFIG_NCURSES
 	/* default is ncurses output */
 	output = &oops_ncurses;
@@ -580,11 +1038,27 @@ int main(int argc, char* argv[])
 		static struct option long_options[] = {
 			{ "realtime",	no_argument,		&opt_realtime, 1},
 			{ "all_cpus",	no_argument,		&opt_all_cpus, 1},
+			{ "align",	no_argument,		&opt_align, 1},
+			{ "event-loop",	no_argument,		&opt_event_loop, 1},
+			{ "pin",	required_argument,	0,  'p' },
 			{ "sort",	required_argument,	0,  's'},
 			{ "output",	required_argument,	0,  'o'},
 			{ "seconds",	required_argument,	0,  't' },
 			{ "milliseconds",required_argument,	0,  'm' },
 			{ "cycles",	required_argument,	0,  'c' },
+			{ "window",	required_argument,	0,  'w' },
+			{ "workers",	required_argument,	0,  'W' },
+			{ "budget",	required_argument,	0,  'B' },
+			{ "exit-shards",required_argument,	0,  'x' },
+			{ "idle-interval",required_argument,	0,  'I' },
+			{ "pids",	required_argument,	0,  'g' },
+			{ "cgroup",	required_argument,	0,  'G' },
+			{ "sample",	required_argument,	0,  'S' },
+			{ "sample-comm",required_argument,	0,  'N' },
+			{ "sample-interval",required_argument,	0,  'M' },
+			{ "per-process",no_argument,		0,  'P' },
+			{ "collapse",	required_argument,	0,  'C' },
+			{ "top",	required_argument,	0,  'T' },
 			{ "help",	no_argument,		0,  'h' },
 			{ 0, 0, 0, 0 },
 		};
@@ -621,6 +1095,10 @@ int main(int argc, char* argv[])
 				opt_sort = OPT_SORT_IO;
 			else if (strcmp(optarg, "mem") == 0)
 				opt_sort = OPT_SORT_MEM;
+			else if (strcmp(optarg, "delay") == 0)
+				opt_sort = OPT_SORT_DELAY;
+			else if (strcmp(optarg, "iodelay") == 0)
+				opt_sort = OPT_SORT_IODELAY;
 			else { /* unknown */
 				fprintf(stderr, "Unknown sort method %s\n", optarg);
 				print_help(argc, argv);
@@ -635,6 +1113,93 @@ int main(int argc, char* argv[])
 		case 'c':
 			cycles = atoi(optarg);
 			break;
+		case 'w':
+			opt_window = atoi(optarg);
+			if (opt_window < 1 || opt_window > QUERY_WINDOW_MAX) {
+				fprintf(stderr, "Invalid window size %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'W':
+			opt_workers = atoi(optarg);
+			if (opt_workers < 1 || opt_workers > MAX_WORKERS) {
+				fprintf(stderr, "Invalid worker count %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'B':
+			opt_budget = atoi(optarg);
+			if (opt_budget < 0 || opt_budget > 100) {
+				fprintf(stderr, "Invalid budget %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'I':
+			opt_idle_interval = atoi(optarg);
+			if (opt_idle_interval < 1) {
+				fprintf(stderr, "Invalid idle interval %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'p':
+			opt_pin = atoi(optarg);
+			if (opt_pin < 0 || opt_pin >= CPU_SETSIZE) {
+				fprintf(stderr, "Invalid cpu %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'G':
+			if (cgroup_add(optarg) < 0) {
+				fprintf(stderr, "Invalid cgroup %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'g':
+			if (scope_parse_pids(optarg) < 0) {
+				fprintf(stderr, "Invalid pid list %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'S':
+			if (hf_parse_ids(optarg) < 0) {
+				fprintf(stderr, "Invalid pid list %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'N':
+			opt_hf_comm = optarg;
+			break;
+		case 'M':
+			opt_hf_interval_ms = atoi(optarg);
+			if (opt_hf_interval_ms < 1) {
+				fprintf(stderr, "Invalid sampling interval %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'P':
+			opt_collapse = 0;
+			break;
+		case 'C':
+			opt_collapse = atoi(optarg);
+			if (opt_collapse < 0) {
+				fprintf(stderr, "Invalid thread count %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'T':
+			opt_top = atoi(optarg);
+			if (opt_top < 1) {
+				fprintf(stderr, "Invalid row count %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
+		case 'x':
+			opt_exit_shards = atoi(optarg);
+			if (opt_exit_shards < 1) {
+				fprintf(stderr, "Invalid exit shard count %s\n", optarg);
+				print_help(argc, argv);
+			}
+			break;
 		case 0:
 			break;
 		case '?':
@@ -644,16 +1209,60 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (!timespec_to_ns(&target)) {
+		fprintf(stderr, "Invalid measurement interval\n");
+		print_help(argc, argv);
+	}
+	if (opt_align)
+		cycle_clock = CLOCK_REALTIME;
+	if (opt_event_loop && opt_workers > 1) {
+		fprintf(stderr, "The event loop runs single threaded, no workers allowed\n");
+		print_help(argc, argv);
+	}
+
+	/* threads of collapsed processes are never queried on their own */
+	if (hf_enabled() && opt_collapse >= 0) {
+		fprintf(stderr, "Sampling needs per-thread queries, no collapsing allowed\n");
+		print_help(argc, argv);
+	}
+
+#ifdef CONFIG_NCURSES
+	if (hf_enabled() && output == &oops_ncurses) {
+		fprintf(stderr, "Sampling needs stdout or csv output\n");
+		print_help(argc, argv);
+	}
+#endif
+
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	if (rc < 0)
+		DIE_PERROR("clock_gettime failed");
 	nr_cpus = get_nr_cpus();
 
-	bm_alloc(PID_MAX);
+	if (opt_pin >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(opt_pin, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			DIE_PERROR("sched_setaffinity failed");
+	}
+
+	table_alloc(pid_max);
+	if (opt_event_loop) {
+		block_signals(&sigmask);
+		start_workers();
+		start_exit_records(0);
+		nl_fd = proc_events_open();
+		goto scanned;
+	}
+
 	rc = pthread_create(&proc_events_thread, NULL, proc_events_main, NULL);
 	if (rc)
 		DIE_PERROR("pthread_create failed");
 	pthread_setname_np(proc_events_thread, "nlmon-pevent");
 
-	setup_netlink();
-	start_task_monitor();
+	start_workers();
+	start_exit_records(1);
 
 	while (!procfs_thread) {
 		DEBUG("...\n");
@@ -667,15 +1276,34 @@ int main(int argc, char* argv[])
 	else
 		DEBUG("procfs scan thread exited\n");
 
+scanned:
+	/* the scan established the baselines, the first cycle shows deltas */
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (rc < 0)
+		DIE_PERROR("clock_gettime failed");
+	elapsed_time(&ts, &ts_startup);
+	nr_cycles = 1;
+
 	data_init_cpu();
 	if (opt_realtime)
 		elevate_prio();
 
 	cache_init();
 	output->init_output();
-	while (cycles--)
-		measure_one_cycle();
+	output->print_banner();
+	if (hf_enabled())
+		start_hf_sampling();
+	init_deadline();
+	if (opt_event_loop)
+		run_event_loop(nl_fd, cycles);
+	else
+		while (cycles--)
+			measure_one_cycle();
+	if (hf_enabled())
+		stop_hf_sampling();
 	output->exit_output();
-	stop_task_monitor();
+	stop_exit_records();
+	stop_workers();
+	proc_events_report();
 	exit(EXIT_SUCCESS);
 }
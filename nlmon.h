@@ -3,11 +3,11 @@
 
 #define _GNU_SOURCE             /* See feature_test_macros(7) */
 #include <time.h>
+#include <signal.h>
 #include <pthread.h>
 #include <linux/taskstats.h>
 
 #include "atomic.h"
-#include "rbtree.h"
 
 #define NSECS_PER_MSEC	(1000000UL)
 
@@ -24,9 +24,13 @@ struct taskstat_delta {
 	char comm[TS_COMM_LEN];
 	int pid;
 	int tid;
-	struct rb_node node;
+	int nr_threads;		/* threads of a process row, 0 for thread rows */
+	struct taskstat_delta *next;	/* pending until added to the cache */
 };
 
+/* deltas come from per-cycle arenas, dropped once the output is done */
+#define DELTA_ARENA_CHUNK	(64 * 1024)
+
 /* sum over all processes utime or stime in the current measurement interval */
 int current_sum_utime;
 int current_sum_stime;
@@ -57,13 +61,13 @@ struct cpu_usage *cpu_delta;
 struct output_operations {
 	void (*init_output)	(void);
 	void (*exit_output)	(void);
-	void (*print_sync)	(void);
-	void (*print_banner)	(struct taskstats *t);
+	void (*print_banner)	(void);
 	void (*print_data)	(struct taskstat_delta *delta);
 	void (*print_cpu_info)	(int cpu, struct cpu_usage *delta);
 	void (*print_mem_info)	(int total, int free);
 	void (*print_cycle_start) (void);
 	void (*print_cycle_end)	(struct timespec *ts);
+	void (*print_sample)	(struct timespec *ts, struct taskstat_delta *delta);
 };
 
 enum sort_options {
@@ -76,7 +80,8 @@ enum sort_options {
 	OPT_SORT_IODELAY,
 };
 
-#define PID_MAX 32768	/* /proc/sys/kernel/pid_max */
+/* /proc/sys/kernel/pid_max, read at startup */
+extern int pid_max;
 
 /* detected once, no CPU hotplug support */
 int nr_cpus;
@@ -85,9 +90,21 @@ short int ts_version;
 int ts_size;
 int nr_cycles;
 
+/* intervals skipped because a cycle overran */
+int nr_overruns;
+
+/* percentage of the tasks visited by the last sweep */
+int sweep_coverage;
+
 /* for csv headers */
 int new_cycle;
 
+/* time since startup when the current cycle started */
+struct timespec ts_cycle;
+
+/* time the connector setup and the initial scan took */
+struct timespec ts_startup;
+
 struct output_operations *output;
 
 /* default intervall is one second */
@@ -96,6 +113,23 @@ extern struct timespec target;
 extern pthread_t procfs_thread;
 extern atomic_t nr_threads;
 
+/* number of exit record sockets */
+extern int opt_exit_shards;
+
+/* processes with more threads are queried per tgid, -1 disables */
+extern int opt_collapse;
+extern int opt_top;
+
+/* high frequency sampling */
+extern int opt_hf_interval_ms;
+extern char *opt_hf_comm;
+
+/* serializes the output of the full sweep and the sampler */
+extern pthread_mutex_t output_lock;
+
+struct task_entry;
+struct query_sock;
+
 /* prototypes */
 void query_cpus(int);
 void print_cpus(int);
@@ -108,5 +142,41 @@ void cache_init(void);
 int cache_add(struct taskstat_delta *delta);
 struct taskstat_delta *cache_walk(struct taskstat_delta *last);
 void cache_flush(void);
+void cache_forget(int id);
+void calc_delta(struct task_entry *h, struct taskstats *t, struct taskstat_delta *delta);
+void calc_proc_delta(struct task_entry *p, struct taskstats *t, struct taskstat_delta *delta);
+void read_comm(int pid, char *comm);
+void start_exit_records(int listener);
+void stop_exit_records(void);
+struct taskstat_delta *collect_exit_records(void);
+void exit_records_reset(void);
+void elapsed_time(const struct timespec *now, struct timespec *res);
+int hf_enabled(void);
+int hf_parse_ids(char *list);
+void hf_watch(struct taskstats *t);
+void start_hf_sampling(void);
+void stop_hf_sampling(void);
+int proc_events_open(void);
+void proc_events_recv(int nl_fd);
+void proc_events_report(void);
+int proc_events_apply(void);
+int scope_parse_pids(char *list);
+int proc_watched(int tgid);
+void proc_events_rescan(void);
+int cgroup_add(const char *path);
+int cgroup_scoped(void);
+int cgroup_read_tids(int **tids, int *max);
+int cgroup_member(int tid);
+void proc_task_gone(int tid);
+struct query_sock *exit_records_socks(int *nr);
+void cycle_begin(void);
+void cycle_end(void);
+void cycle_deadline(clockid_t *clock, struct timespec *ts);
+void sweep_begin(void);
+int sweep_step(void);
+struct query_sock *sweep_socket(void);
+void run_event_loop(int nl_fd, int cycles);
+void block_signals(sigset_t *mask);
+void baseline_open(struct query_sock *qs);
 
 #endif
@@ -10,22 +10,26 @@
 #include "helper.h"
 #include "nlmon.h"
 
-static void print_banner_csv(struct taskstats *t)
+static void print_banner_csv(void)
 {
-	printf("HEADER;TSVersion;TSSize\n");
-	printf("BANNER;%d;%zu\n", t->version, sizeof(*t));
+	printf("HEADER;TSVersion;TSSize;Startup[ms];Threads\n");
+	printf("BANNER;%d;%d;%lu;%u\n", ts_version, ts_size,
+		ts_startup.tv_sec * 1000 + ts_startup.tv_nsec / NSECS_PER_MSEC,
+		atomic_read(&nr_threads));
 }
 
 static void print_cycle_start_csv(void)
 {
-	printf("HEADER;Cycle;Threads\n");
-	printf("MEASUREMENT;%d;%u\n", nr_cycles, atomic_read(&nr_threads));
+	printf("HEADER;Cycle;Threads;Time[sec]\n");
+	printf("MEASUREMENT;%d;%u;%lu.%03lu\n", nr_cycles, atomic_read(&nr_threads),
+		ts_cycle.tv_sec, ts_cycle.tv_nsec / NSECS_PER_MSEC);
 }
 
 static void print_cycle_end_csv(struct timespec *ts)
 {
-	printf("HEADER;Cycle_used_sec;Cycle_used_ms\n");
-	printf("MEASUREMENT;%u;%lu\n",	(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC);
+	printf("HEADER;Cycle_used_sec;Cycle_used_ms;Overruns;Coverage[%%]\n");
+	printf("MEASUREMENT;%u;%lu;%d;%d\n", (int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC,
+		nr_overruns, sweep_coverage);
 	fflush(stdout);
 }
 
@@ -38,7 +42,8 @@ static void print_data_csv(struct taskstat_delta *delta)
 		printf("HEADER;PID;TID;Name;UserT[ms];SysT[ms];TotalT[sec];Rss[MB];IORead[Bytes];IOWrite[Bytes];IODelay[ms];Iteration\n");
 		new_cycle = 0;
 	}
-	printf("THREAD;%d;%d;%s;%llu;%llu;%f;%llu;%llu;%llu;%llu;%d\n",
+	printf("%s;%d;%d;%s;%llu;%llu;%f;%llu;%llu;%llu;%llu;%d\n",
+		delta->nr_threads ? "PROCESS" : "THREAD",
 		delta->pid,
 		delta->tid,
 		delta->comm,
@@ -53,6 +58,27 @@ static void print_data_csv(struct taskstat_delta *delta)
 		);
 }
 
+static void print_sample_csv(struct timespec *ts, struct taskstat_delta *delta)
+{
+	static int header;
+
+	if (!header) {
+		printf("HEADER;Time[sec];PID;TID;Name;UserT[us];SysT[us];CpuDelay[us];IODelay[us]\n");
+		header = 1;
+	}
+	printf("SAMPLE;%lu.%06lu;%d;%d;%s;%llu;%llu;%llu;%llu\n",
+		ts->tv_sec, ts->tv_nsec / 1000,
+		delta->pid,
+		delta->tid,
+		delta->comm,
+		delta->utime,
+		delta->stime,
+		delta->cpu_delay / 1000,
+		delta->blkio_delay / 1000
+		);
+	fflush(stdout);
+}
+
 static void print_cpu_info_csv(int i, struct cpu_usage *delta)
 {
 	// TODO: only print once for all cpus
@@ -75,18 +101,17 @@ static void print_mem_info_csv(int total, int free)
 	printf("%9u;%9u;%9u\n", total, total - free, free);
 }
 
-static void print_sync(void) { }
 static void init_output(void) { }
 static void exit_output(void) { }
 
 struct output_operations oops_csv = {
 	.init_output =		init_output,
 	.exit_output =		exit_output,
-	.print_sync =		print_sync,
 	.print_banner =		print_banner_csv,
 	.print_data =		print_data_csv,
 	.print_cpu_info =	print_cpu_info_csv,
 	.print_mem_info =	print_mem_info_csv,
 	.print_cycle_start =	print_cycle_start_csv,
 	.print_cycle_end =	print_cycle_end_csv,
+	.print_sample =		print_sample_csv,
 };
@@ -19,13 +19,6 @@ static WINDOW *cpus;
 static int max_output_lines;
 static int used_output_lines;
 
-static void print_sync_ncurses(void)
-{
-	wclear(threads);
-	wclear(cpus);
-	mvwprintw(threads, 20, 20, "... Synching ...\n");
-}
-
 static void print_cycle_start_ncurses(void)
 {
 	used_output_lines = max_output_lines;
@@ -34,7 +27,8 @@ static void print_cycle_start_ncurses(void)
 	wclear(cpus);
 	wprintw(threads, "Taskstats version: %d  Taskstat size: %lu  ", ts_version, ts_size);
 	wprintw(threads, "Measurement cycle: %d  Interval: %us.%ums  ", nr_cycles, target.tv_sec, target.tv_nsec / NSECS_PER_MSEC);
-	wprintw(threads, "Threads: %u\n", atomic_read(&nr_threads));
+	wprintw(threads, "Threads: %u  ", atomic_read(&nr_threads));
+	wprintw(threads, "Startup: %lu.%03lus\n", ts_startup.tv_sec, ts_startup.tv_nsec / NSECS_PER_MSEC);
 	wprintw(threads, "\n");
 	wprintw(threads,
 		"%5s  %16s   %6s    %6s  %9s    %6s    %8s    %8s    %9s\n",
@@ -70,7 +64,8 @@ static void print_cycle_end_ncurses(struct timespec *ts)
 			err_utime + err_stime,
 			(100 * (err_utime + err_stime)) / total_100p
 			);
-	wprintw(cpus, "\t\t\t\t... took: %us %lums\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC);
+	wprintw(cpus, "\t\t\t\t... took: %us %lums  overruns: %d  coverage: %d%%\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC,
+		nr_overruns, sweep_coverage);
 
 	/* now refresh all windows */
 	wrefresh(threads);
@@ -82,8 +77,10 @@ static void print_data_ncurses(struct taskstat_delta *delta)
 	if (used_output_lines <= 0)
 		return;
 
-	wprintw(threads, "%5d  %16s  %6llu        %6llu     %9llu      %6llu      %8llu          %8llu         %9llu\n",
+	/* process rows are marked with a star */
+	wprintw(threads, "%5d%c %16s  %6llu        %6llu     %9llu      %6llu      %8llu          %8llu         %9llu\n",
 		delta->tid,
+		delta->nr_threads ? '*' : ' ',
 		delta->comm,
 		delta->utime / 1000,
 		delta->stime / 1000,
@@ -163,16 +160,20 @@ static void exit_ncurses(void)
 	endwin();
 }
 
-static void print_banner(struct taskstats *t) { }
+/* the screen is redrawn every cycle, the header line shows the startup time */
+static void print_banner(void) { }
+
+/* samples would be wiped with the next cycle, not supported */
+static void print_sample(struct timespec *ts, struct taskstat_delta *delta) { }
 
 struct output_operations oops_ncurses = {
 	.init_output =		init_ncurses,
 	.exit_output =		exit_ncurses,
-	.print_sync =		print_sync_ncurses,
 	.print_banner =		print_banner,
 	.print_data =		print_data_ncurses,
 	.print_cpu_info =	print_cpu_info_ncurses,
 	.print_mem_info =	print_mem_info_ncurses,
 	.print_cycle_start =	print_cycle_start_ncurses,
 	.print_cycle_end =	print_cycle_end_ncurses,
+	.print_sample =		print_sample,
 };
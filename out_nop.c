@@ -10,14 +10,14 @@
 #include "helper.h"
 #include "nlmon.h"
 
-static void print_banner_nop(struct taskstats *t)
+static void print_banner_nop(void)
 {
-	printf("\nTaskstats version: %d  Taskstat size: %zu\n", t->version, sizeof(*t));
+	printf("\nTaskstats version: %d  Taskstat size: %d\n", ts_version, ts_size);
+	printf("Startup: %lu.%03lus  threads: %u\n", ts_startup.tv_sec,
+		ts_startup.tv_nsec / NSECS_PER_MSEC, atomic_read(&nr_threads));
 	printf("\n");
 }
 
-static void print_sync_nop(void) { }
-
 static void print_cycle_start_nop(void)
 {
 	printf("measurement cycle: %d  threads: %u\n", nr_cycles, atomic_read(&nr_threads));
@@ -25,24 +25,26 @@ static void print_cycle_start_nop(void)
 
 static void print_cycle_end_nop(struct timespec *ts)
 {
-	printf("... took: %us %lums\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC);
+	printf("... took: %us %lums  overruns: %d  coverage: %d%%\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC,
+		nr_overruns, sweep_coverage);
 	fflush(stdout);
 }
 
 static void print_data_nop(struct taskstat_delta *delta) { }
 static void print_cpu_info_nop(int i, struct cpu_usage *delta) { }
 static void print_mem_info_nop(total, free) { }
+static void print_sample_nop(struct timespec *ts, struct taskstat_delta *delta) { }
 static void init_output(void) { }
 static void exit_output(void) { }
 
 struct output_operations oops_nop = {
 	.init_output =		init_output,
 	.exit_output =		exit_output,
-	.print_sync =		print_sync_nop,
 	.print_banner =		print_banner_nop,
 	.print_data =		print_data_nop,
 	.print_cpu_info =	print_cpu_info_nop,
 	.print_mem_info =	print_mem_info_nop,
 	.print_cycle_start =	print_cycle_start_nop,
 	.print_cycle_end =	print_cycle_end_nop,
+	.print_sample =		print_sample_nop,
 };
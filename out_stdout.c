@@ -12,27 +12,26 @@
 
 #define average_ms(t, c) (t / 1000000ULL / (c ? c : 1))
 
-static void print_banner_stdout(struct taskstats *t)
+static void print_banner_stdout(void)
 {
-	printf("\nTaskstats version: %d  Taskstat size: %zu\n", t->version, sizeof(*t));
+	printf("\nTaskstats version: %d  Taskstat size: %d\n", ts_version, ts_size);
+	printf("Startup: %lu.%03lus  threads: %u\n", ts_startup.tv_sec,
+		ts_startup.tv_nsec / NSECS_PER_MSEC, atomic_read(&nr_threads));
 	printf("\n");
 }
 
-static void print_sync_stdout(void)
-{
-	printf("... Syncing ...\n");
-}
-
 static void print_cycle_start_stdout(void)
 {
-	printf("measurement cycle: %d  threads: %u\n", nr_cycles, atomic_read(&nr_threads));
+	printf("measurement cycle: %d  threads: %u  time: %lu.%03lu\n", nr_cycles, atomic_read(&nr_threads),
+		ts_cycle.tv_sec, ts_cycle.tv_nsec / NSECS_PER_MSEC);
 }
 
 static void print_cycle_end_stdout(struct timespec *ts)
 {
 	printf("ERROR [ms]: user: %4u  system: %4u  total: %4u\n",
 		current_sum_utime, current_sum_stime, current_sum_utime + current_sum_stime);
-	printf("... took: %us %lums\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC);
+	printf("... took: %us %lums  overruns: %d  coverage: %d%%\n\n",(int) ts->tv_sec, ts->tv_nsec / NSECS_PER_MSEC,
+		nr_overruns, sweep_coverage);
 	fflush(stdout);
 }
 
@@ -68,9 +67,13 @@ static void print_data_stdout(struct taskstat_delta *delta)
 	       average_ms(t->freepages_delay_total, t->freepages_count));
 	*/
 
-	printf("PID: %5d [%16s]  user: %6llu  system: %6llu  rss: %6llu  io_rd: %8llu  io_wr: %8llu  blkio_delay: %9llu\n",
-		delta->tid,
-		delta->comm,
+	/* process rows are labeled with the number of collapsed threads */
+	if (delta->nr_threads)
+		printf("PROC: %5d [%16s]  threads: %4d", delta->tid, delta->comm, delta->nr_threads);
+	else
+		printf("PID: %5d [%16s]", delta->tid, delta->comm);
+
+	printf("  user: %6llu  system: %6llu  rss: %6llu  io_rd: %8llu  io_wr: %8llu  blkio_delay: %9llu\n",
 		delta->utime / 1000,
 		delta->stime / 1000,
 		(delta->utime + delta->stime) ? delta->rss / (delta->utime + delta->stime) : 0,
@@ -80,6 +83,20 @@ static void print_data_stdout(struct taskstat_delta *delta)
 	);
 }
 
+/* high frequency samples are in microseconds */
+static void print_sample_stdout(struct timespec *ts, struct taskstat_delta *delta)
+{
+	printf("SAMPLE: %lu.%06lu  TID: %5d [%16s]  user: %6llu  system: %6llu  cpu_delay: %6llu  blkio_delay: %6llu\n",
+		ts->tv_sec, ts->tv_nsec / 1000,
+		delta->tid, delta->comm,
+		delta->utime,
+		delta->stime,
+		delta->cpu_delay / 1000,
+		delta->blkio_delay / 1000
+	);
+	fflush(stdout);
+}
+
 static void print_cpu_info_stdout(int i, struct cpu_usage *delta)
 {
 	printf("CPU%d  [ms]  user: %4u  system: %4u  irq: %4u  softirq: %4u  iowait: %4u  idle: %4u\n",
@@ -105,11 +122,11 @@ static void exit_output(void) { }
 struct output_operations oops_stdout = {
 	.init_output =		init_output,
 	.exit_output =		exit_output,
-	.print_sync =		print_sync_stdout,
 	.print_banner =		print_banner_stdout,
 	.print_data =		print_data_stdout,
 	.print_cpu_info =	print_cpu_info_stdout,
 	.print_mem_info =	print_mem_info_stdout,
 	.print_cycle_start =	print_cycle_start_stdout,
 	.print_cycle_end =	print_cycle_end_stdout,
+	.print_sample =		print_sample_stdout,
 };
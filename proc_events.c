@@ -21,14 +21,18 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <dirent.h>
-#include <ctype.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
 
 #include "helper.h"
-#include "bitmap.h"
-#include "hash.h"
+#include "table.h"
+#include "query.h"
+#include "ring.h"
 #include "nlmon.h"
+#include "ids.h"
 
 /* one-shot scan thread */
 pthread_t procfs_thread;
@@ -36,11 +40,125 @@ pthread_t procfs_thread;
 /* number of currently running threads */
 atomic_t nr_threads;
 
+/* events taken per recvmmsg() call */
+#define CN_RX_BATCH	64
+#define CN_RCVBUF	(4 * 1024 * 1024)
+
+/* startup scan, processes are handed out in chunks */
+#define SCAN_MAX_THREADS	16
+#define SCAN_CHUNK		64
+#define SCAN_DENTS_SIZE		(32 * 1024)
+
+/* offsets into the netlink message for the socket filter */
+#define EV_WHAT_OFF		36
+#define EV_TGID_OFF		56	/* process_tgid of exit, comm and exec */
+#define EV_CHILD_TGID_OFF	64	/* child_tgid of fork */
+
+/* processes watched in scoped mode */
+#define SCOPE_MAX_PIDS		64
+
+/* events queued between two sweeps */
+#define EVENT_RING_SIZE		(64 * 1024)
+
+/* size of the name in comm events */
+#define TASK_COMM_LEN	16
+
+/*
+ * The connector numbers the events per cpu before the socket filter runs,
+ * the gaps are the filtered events. Drops show up as ENOBUFS, the gaps from
+ * then on until the resync finished are counted as lost events.
+ */
+static __u32 *cpu_seq;
+static char *cpu_seq_valid;
+static int events_dropped;
+
+static unsigned long nr_events;
+static unsigned long nr_filtered_events;
+static unsigned long nr_lost_events;
+static unsigned long nr_overflows;
+static unsigned long nr_resyncs;
+static unsigned long nr_resync_added;
+static unsigned long nr_resync_removed;
+static int resync_running;
+
+/* only these processes and their threads are tracked if set */
+static int scope_pids[SCOPE_MAX_PIDS];
+static int nr_scope_pids;
+
+/* compact copy of an event for the sweep */
+struct task_event {
+	int what;
+	int tid;
+	int tgid;
+	int ptid;		/* parent of a fork */
+	char comm[TASK_COMM_LEN];
+};
+
+/* filled by the connector, drained by the sweep */
+static struct ring event_ring;
+
+/* parse a comma separated list of pids for the scoped mode */
+int scope_parse_pids(char *list)
+{
+	return ids_parse(list, scope_pids, &nr_scope_pids, SCOPE_MAX_PIDS);
+}
+
+/* without a scope every process is watched */
+int proc_watched(int tgid)
+{
+	int i;
+
+	if (!nr_scope_pids)
+		return 1;
+	for (i = 0; i < nr_scope_pids; i++)
+		if (scope_pids[i] == tgid)
+			return 1;
+	return 0;
+}
+
+/*
+ * Classic BPF filter that passes fork, exit, comm and exec events only, in
+ * scoped mode only for the watched processes. Loads are in network byte
+ * order. Filtered events still take a sequence number so the gaps count
+ * them.
+ */
+static void attach_filter(int nl_fd)
+{
+	struct sock_filter code[8 + SCOPE_MAX_PIDS + 2];
+	struct sock_fprog prog;
+	int n = 0, i;
+
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, EV_WHAT_OFF);
+	code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_FORK), 0, 2);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, EV_CHILD_TGID_OFF);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_JMP | BPF_JA, 5);
+	code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXIT), 3, 0);
+	code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_COMM), 2, 0);
+	code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 1, 0);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, EV_TGID_OFF);
+
+	/* the tgid is in A, without a scope everything passes */
+	for (i = 0; i < nr_scope_pids; i++)
+		code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+				htonl(scope_pids[i]), nr_scope_pids - i, 0);
+	if (nr_scope_pids)
+		code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+	code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		DIE_PERROR("setsockopt SO_ATTACH_FILTER failed");
+}
+
 static int setup_connector(void)
 {
 	struct sockaddr_nl nl_sa;
 	int rc, nl_fd;
 
+	ring_alloc(&event_ring, EVENT_RING_SIZE, sizeof(struct task_event));
+
 	nl_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
 	if (nl_fd < 0)
 		DIE_PERROR("socket failed");
@@ -52,6 +170,17 @@ static int setup_connector(void)
 	rc = bind(nl_fd, (struct sockaddr *) &nl_sa, sizeof(nl_sa));
 	if (rc < 0)
 		DIE_PERROR("bind failed");
+	attach_filter(nl_fd);
+
+	/* fork storms need room, overflows are detected and resynced anyway */
+	rc = CN_RCVBUF;
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rc, sizeof(rc)) < 0)
+		setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &rc, sizeof(rc));
+
+	cpu_seq = calloc(nr_cpus, sizeof(__u32));
+	cpu_seq_valid = calloc(nr_cpus, 1);
+	if (!cpu_seq || !cpu_seq_valid)
+		DIE_PERROR("calloc failed");
 	return nl_fd;
 }
 
@@ -94,113 +223,619 @@ struct nlcn_recv_msg {
 	} __attribute__ ((__packed__));
 } __attribute__ ((aligned(NLMSG_ALIGNTO)));
 
-static void handle_proc_ev(int nl_fd)
+/* ignores tasks that are live already, returns 1 if the task was added */
+static int track_task(int tid, int tgid, int moved_in)
+{
+	if (!task_start(tid, tgid, moved_in))
+		return 0;
+	atomic_inc(&nr_threads);
+	return 1;
+}
+
+/* the entry is removed after the exit record was accounted */
+static int untrack_task(int tid)
+{
+	if (!task_exit(tid, nr_cycles))
+		return 0;
+	atomic_dec(&nr_threads);
+	cache_forget(tid);
+	return 1;
+}
+
+/*
+ * The name of the process is the name of the leader. An empty name is
+ * filled in again from the next reply.
+ */
+static void set_comm(int tid, int tgid, const char *comm)
 {
-	struct nlcn_recv_msg nlcn_msg;
+	struct task_entry *h;
+
+	h = get_task_entry(tid);
+	if (h) {
+		memset(h->comm, 0, TS_COMM_LEN);
+		strncpy(h->comm, comm, TASK_COMM_LEN);
+		put_task_entry(tid);
+	}
+	if (tid != tgid)
+		return;
+	h = get_proc_entry(tgid);
+	if (h) {
+		memset(h->comm, 0, TS_COMM_LEN);
+		strncpy(h->comm, comm, TASK_COMM_LEN);
+		put_task_entry(tgid);
+	}
+}
+
+/* for tasks that turned out to be gone without an exit event */
+void proc_task_gone(int tid)
+{
+	untrack_task(tid);
+}
+
+static void *resync_main(void *unused);
+
+static void start_resync(void)
+{
+	pthread_t thread;
 	int rc;
 
-	while (1) {
-		rc = recv(nl_fd, &nlcn_msg, sizeof(nlcn_msg), 0);
-		if (!rc) {
-			/* shutdown? */
-			return;
-		} else if (rc < 0) {
-			if (errno == EINTR)
-				continue;
-			DIE_PERROR("receive failed");
-		}
+	if (!__sync_bool_compare_and_swap(&resync_running, 0, 1))
+		return;
+	rc = pthread_create(&thread, NULL, resync_main, NULL);
+	if (rc)
+		DIE_PERROR("pthread_create failed");
+	pthread_detach(thread);
+	pthread_setname_np(thread, "nlmon-resync");
+}
+
+static void check_seq(struct nlcn_recv_msg *nlcn_msg)
+{
+	unsigned int cpu = nlcn_msg->proc_ev.cpu;
+	__u32 seq = nlcn_msg->cn_msg.seq;
+
+	if (cpu >= nr_cpus)
+		return;
+	if (cpu_seq_valid[cpu]) {
+		if (__atomic_load_n(&events_dropped, __ATOMIC_ACQUIRE))
+			nr_lost_events += seq - cpu_seq[cpu] - 1;
+		else
+			nr_filtered_events += seq - cpu_seq[cpu] - 1;
+	}
+	cpu_seq[cpu] = seq;
+	cpu_seq_valid[cpu] = 1;
+}
+
+/* runs on the connector thread, the tracking is left to the sweep */
+static void handle_event(struct nlcn_recv_msg *nlcn_msg)
+{
+	struct task_event ev;
+
+	nr_events++;
+	check_seq(nlcn_msg);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.what = nlcn_msg->proc_ev.what;
+
+	switch (nlcn_msg->proc_ev.what) {
+	case PROC_EVENT_FORK:
+		DEBUG("fork: parent tid=%d pid=%d -> child tid=%d pid=%d\n",
+		//fprintf(stderr, "fork: parent tid=%d pid=%d -> child tid=%d pid=%d\n",
+			nlcn_msg->proc_ev.event_data.fork.parent_pid,
+			nlcn_msg->proc_ev.event_data.fork.parent_tgid,
+			nlcn_msg->proc_ev.event_data.fork.child_pid,
+			nlcn_msg->proc_ev.event_data.fork.child_tgid);
+		ev.tid = nlcn_msg->proc_ev.event_data.fork.child_pid;
+		ev.tgid = nlcn_msg->proc_ev.event_data.fork.child_tgid;
+		ev.ptid = nlcn_msg->proc_ev.event_data.fork.parent_pid;
+		break;
+	case PROC_EVENT_EXIT:
+		DEBUG("exit: tid=%d pid=%d exit_code=%d\n",
+		//fprintf(stderr, "exit: tid=%d pid=%d exit_code=%d\n",
+			nlcn_msg->proc_ev.event_data.exit.process_pid,
+			nlcn_msg->proc_ev.event_data.exit.process_tgid,
+			nlcn_msg->proc_ev.event_data.exit.exit_code);
+		ev.tid = nlcn_msg->proc_ev.event_data.exit.process_pid;
+		ev.tgid = nlcn_msg->proc_ev.event_data.exit.process_tgid;
+		break;
+	case PROC_EVENT_COMM:
+		DEBUG("comm: tid=%d pid=%d comm=%.16s\n",
+			nlcn_msg->proc_ev.event_data.comm.process_pid,
+			nlcn_msg->proc_ev.event_data.comm.process_tgid,
+			nlcn_msg->proc_ev.event_data.comm.comm);
+		ev.tid = nlcn_msg->proc_ev.event_data.comm.process_pid;
+		ev.tgid = nlcn_msg->proc_ev.event_data.comm.process_tgid;
+		memcpy(ev.comm, nlcn_msg->proc_ev.event_data.comm.comm, TASK_COMM_LEN);
+		break;
+	case PROC_EVENT_EXEC:
+		DEBUG("exec: tid=%d pid=%d\n",
+			nlcn_msg->proc_ev.event_data.exec.process_pid,
+			nlcn_msg->proc_ev.event_data.exec.process_tgid);
+		ev.tid = nlcn_msg->proc_ev.event_data.exec.process_pid;
+		ev.tgid = nlcn_msg->proc_ev.event_data.exec.process_tgid;
+		break;
+		/* TODO: is PROC_EVENT_COREDUMP also an exit event? */
+		/* ignore all others */
+	default:
+		return;
+	}
+
+	/* a full ring loses events like a connector overflow */
+	if (ring_push(&event_ring, &ev) < 0)
+		start_resync();
+}
+
+/*
+ * The parent of a new thread is the parent of the whole process, a thread
+ * belongs to the cgroups if its process is tracked. The leader may be gone
+ * while other threads still run.
+ */
+static int fork_tracked(struct task_event *ev)
+{
+	struct task_entry *p;
+	int live;
+
+	if (ev->tid == ev->tgid)
+		return task_tracked(ev->ptid);
+	if (task_tracked(ev->tgid))
+		return 1;
+	p = get_proc_entry(ev->tgid);
+	if (!p)
+		return 0;
+	live = p->nr_threads > 0;
+	put_task_entry(ev->tgid);
+	return live;
+}
+
+/*
+ * Applies the queued events to the tracking structures, called by the sweep
+ * before the tasks are queried. Returns the number of events applied.
+ */
+int proc_events_apply(void)
+{
+	struct task_event ev;
+	int nr = 0;
 
-		switch (nlcn_msg.proc_ev.what) {
+	while (!ring_pop(&event_ring, &ev)) {
+		switch (ev.what) {
 		case PROC_EVENT_FORK:
-			DEBUG("fork: parent tid=%d pid=%d -> child tid=%d pid=%d\n",
-			//fprintf(stderr, "fork: parent tid=%d pid=%d -> child tid=%d pid=%d\n",
-				nlcn_msg.proc_ev.event_data.fork.parent_pid,
-				nlcn_msg.proc_ev.event_data.fork.parent_tgid,
-				nlcn_msg.proc_ev.event_data.fork.child_pid,
-				nlcn_msg.proc_ev.event_data.fork.child_tgid);
-			bm_set(nlcn_msg.proc_ev.event_data.fork.child_pid);
-			create_hash_entry(nlcn_msg.proc_ev.event_data.fork.child_pid, nlcn_msg.proc_ev.event_data.fork.child_tgid);
-			atomic_inc(&nr_threads);
+			/* children inherit the cgroup of the parent */
+			if (cgroup_scoped() && !fork_tracked(&ev))
+				break;
+			track_task(ev.tid, ev.tgid, 0);
 			break;
 		case PROC_EVENT_EXIT:
-			DEBUG("exit: tid=%d pid=%d exit_code=%d\n",
-			//fprintf(stderr, "exit: tid=%d pid=%d exit_code=%d\n",
-				nlcn_msg.proc_ev.event_data.exit.process_pid,
-				nlcn_msg.proc_ev.event_data.exit.process_tgid,
-				nlcn_msg.proc_ev.event_data.exit.exit_code);
-			// TODO: do not remove imeediately, a seperate exit event will follow containing the exit time,
-			// only remove the pid after that one was given out...
-			bm_clear(nlcn_msg.proc_ev.event_data.exit.process_pid);
-			remove_hash_entry(nlcn_msg.proc_ev.event_data.exit.process_pid);
-			atomic_dec(&nr_threads);
+			untrack_task(ev.tid);
+			break;
+		case PROC_EVENT_COMM:
+			set_comm(ev.tid, ev.tgid, ev.comm);
 			break;
-			/* TODO: is PROC_EVENT_COREDUMP also an exit event? */
-			/* ignore all others */
-		default:
+		case PROC_EVENT_EXEC:
+			/* exec sets the new name without a comm event */
+			set_comm(ev.tid, ev.tgid, "");
 			break;
 		}
+		nr++;
+	}
+	return nr;
+}
+
+static struct nlcn_recv_msg rx_msgs[CN_RX_BATCH];
+static struct mmsghdr rx_mm[CN_RX_BATCH];
+static struct iovec rx_iov[CN_RX_BATCH];
+
+/*
+ * Takes a batch of events with one syscall. Returns the number of events, 0
+ * if nothing was pending and -1 on shutdown.
+ */
+static int recv_events(int nl_fd, int flags)
+{
+	int i, rc;
+
+	for (i = 0; i < CN_RX_BATCH; i++) {
+		rx_iov[i].iov_base = &rx_msgs[i];
+		rx_iov[i].iov_len = sizeof(rx_msgs[i]);
+		rx_mm[i].msg_hdr.msg_iov = &rx_iov[i];
+		rx_mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	rc = recvmmsg(nl_fd, rx_mm, CN_RX_BATCH, flags, NULL);
+	if (!rc)
+		return -1;
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		if (errno == ENOBUFS) {
+			/* events were dropped, we cannot tell how many */
+			nr_overflows++;
+			__atomic_store_n(&events_dropped, 1, __ATOMIC_RELEASE);
+			DEBUG("connector overflow\n");
+			start_resync();
+			return 0;
+		}
+		DIE_PERROR("receive failed");
 	}
+
+	for (i = 0; i < rc; i++) {
+		if (rx_mm[i].msg_len < sizeof(struct nlcn_recv_msg))
+			continue;
+		if (rx_msgs[i].nl_hdr.nlmsg_type != NLMSG_DONE)
+			continue;
+		handle_event(&rx_msgs[i]);
+	}
+	return rc;
+}
+
+static void handle_proc_ev(int nl_fd)
+{
+	while (recv_events(nl_fd, MSG_WAITFORONE) >= 0)
+		;
+}
+
+/* event loop variant, takes all pending events without blocking */
+void proc_events_recv(int nl_fd)
+{
+	while (recv_events(nl_fd, MSG_DONTWAIT) == CN_RX_BATCH)
+		;
+}
+
+struct linux_dirent64 {
+	__u64 d_ino;
+	__s64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* returns 0 for anything but a plain number */
+static int parse_id(const char *name)
+{
+	int id = 0;
+
+	if (!*name)
+		return 0;
+	for (; *name; name++) {
+		if (*name < '0' || *name > '9')
+			return 0;
+		id = id * 10 + *name - '0';
+	}
+	return id;
+}
+
+/*
+ * Collects the numeric entries of a /proc directory with getdents64, the
+ * array grows as needed. Returns -1 if the directory is gone.
+ */
+static int read_ids(const char *path, int **ids, int *max)
+{
+	char buf[SCAN_DENTS_SIZE] __attribute__ ((aligned(8)));
+	struct linux_dirent64 *d;
+	int fd, len, pos, id, nr = 0;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *) (buf + pos);
+			id = parse_id(d->d_name);
+			if (id > 0)
+				ids_add(id, ids, &nr, max);
+		}
+	}
+	close(fd);
+	return nr;
 }
 
 /* Note: errors may happen here since the process may be already gone */
-static int scan_procfs_threads(int pid)
+static int read_threads(int pid, int **tids, int *max)
 {
-	int len, tid, count = 0;
-	struct dirent *dentry;
 	char name[30];
-	DIR *dir;
 
-	memset(name, 0, 30);
-	snprintf(name, 30, "/proc/%d/task", pid);
-	dir = opendir(name);
-	if (!dir)
+	snprintf(name, sizeof(name), "/proc/%d/task", pid);
+	return read_ids(name, tids, max);
+}
+
+/* all processes or the watched ones */
+static int read_pids(int **pids, int *max)
+{
+	int nr;
+
+	if (nr_scope_pids) {
+		*pids = malloc(nr_scope_pids * sizeof(int));
+		if (!*pids)
+			DIE_PERROR("malloc failed");
+		memcpy(*pids, scope_pids, nr_scope_pids * sizeof(int));
+		*max = nr_scope_pids;
+		return nr_scope_pids;
+	}
+
+	nr = read_ids("/proc", pids, max);
+	if (nr < 0)
+		DIE_PERROR("open /proc failed");
+	return nr;
+}
+
+static int read_tgid(int tid)
+{
+	char name[32], line[64];
+	int tgid = 0;
+	FILE *fp;
+
+	snprintf(name, sizeof(name), "/proc/%d/status", tid);
+	fp = fopen(name, "r");
+	if (!fp)
 		return 0;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "Tgid: %d", &tgid) == 1)
+			break;
+	fclose(fp);
+	return tgid;
+}
+
+/* the cgroups list threads, not processes */
+static void scan_cgroup_tasks(void (*fn)(int tid, int tgid))
+{
+	int *tids = NULL, max_tids = 0;
+	int i, nr, tgid;
+
+	nr = cgroup_read_tids(&tids, &max_tids);
+	for (i = 0; i < nr; i++) {
+		tgid = read_tgid(tids[i]);
+		if (tgid)
+			fn(tids[i], tgid);
+	}
+	free(tids);
+}
+
+static void scan_procfs_tasks(void (*fn)(int tid, int tgid))
+{
+	int *pids = NULL, *tids = NULL;
+	int max_pids = 0, max_tids = 0;
+	int i, j, nr_pids, nr_tids;
+
+	if (cgroup_scoped()) {
+		scan_cgroup_tasks(fn);
+		return;
+	}
+	nr_pids = read_pids(&pids, &max_pids);
+
+	for (i = 0; i < nr_pids; i++) {
+		nr_tids = read_threads(pids[i], &tids, &max_tids);
+		for (j = 0; j < nr_tids; j++)
+			fn(tids[j], pids[i]);
+	}
+	free(tids);
+	free(pids);
+}
+
+/*
+ * The startup scan is split over a pool of threads. Every thread tracks the
+ * tasks of a chunk of processes and queries their baselines right away so
+ * the first cycle already shows deltas.
+ */
+struct scan_worker {
+	pthread_t thread;
+	struct query_sock qs;
+	int *tids;
+	int max_tids;
+};
+
+static int *scan_pids;
+static int nr_scan_pids;
+static int scan_next;
+
+static void scan_process(struct scan_worker *w, int pid)
+{
+	struct task_entry *p;
+	int i, nr;
+
+	nr = read_threads(pid, &w->tids, &w->max_tids);
+	if (nr <= 0)
+		return;
+
+	for (i = 0; i < nr; i++)
+		track_task(w->tids[i], pid, 0);
+
+	/* processes that are going to be collapsed need the tgid baseline */
+	if (opt_collapse >= 0 && nr > opt_collapse) {
+		p = get_proc_entry(pid);
+		if (p) {
+			p->collapsed = 1;
+			put_task_entry(pid);
+		}
+		query_submit(&w->qs, pid, TASKSTATS_CMD_ATTR_TGID);
+		return;
+	}
+	for (i = 0; i < nr; i++)
+		query_submit(&w->qs, w->tids[i], TASKSTATS_CMD_ATTR_PID);
+}
+
+/* in cgroup scoped mode the scan hands out tids */
+static void scan_cgroup_task(struct scan_worker *w, int tid)
+{
+	int tgid = read_tgid(tid);
+
+	if (!tgid)
+		return;
+	track_task(tid, tgid, 0);
+	query_submit(&w->qs, tid, TASKSTATS_CMD_ATTR_PID);
+}
 
-	while ((dentry = readdir(dir)) != NULL) {
-                if (dentry->d_name[0] == '.')
-                        continue;
-                len = strlen(dentry->d_name);
-                if (!len)
-                        continue;
-                /* we're only interested in tid files */
-                if (!isdigit(dentry->d_name[0]))
-                        DIE("invalid file found");
-		tid = atoi(dentry->d_name);
-		bm_set(tid);
-		create_hash_entry(tid, pid);
-		count++;
+static void *scan_worker_main(void *arg)
+{
+	struct scan_worker *w = arg;
+	int first, i;
+
+	for (;;) {
+		first = __sync_fetch_and_add(&scan_next, SCAN_CHUNK);
+		if (first >= nr_scan_pids)
+			break;
+		for (i = first; i < min(first + SCAN_CHUNK, nr_scan_pids); i++) {
+			if (cgroup_scoped())
+				scan_cgroup_task(w, scan_pids[i]);
+			else
+				scan_process(w, scan_pids[i]);
+		}
+	}
+	query_drain(&w->qs);
+	return NULL;
+}
+
+static void scan_startup(void)
+{
+	struct scan_worker *workers;
+	int max_pids = 0, nr, i, rc;
+
+	if (cgroup_scoped())
+		nr_scan_pids = cgroup_read_tids(&scan_pids, &max_pids);
+	else
+		nr_scan_pids = read_pids(&scan_pids, &max_pids);
+
+	nr = max(min(nr_cpus, SCAN_MAX_THREADS), 1);
+	workers = calloc(nr, sizeof(struct scan_worker));
+	if (!workers)
+		DIE_PERROR("calloc failed");
+
+	for (i = 0; i < nr; i++)
+		baseline_open(&workers[i].qs);
+	for (i = 1; i < nr; i++) {
+		rc = pthread_create(&workers[i].thread, NULL, scan_worker_main, &workers[i]);
+		if (rc)
+			DIE_PERROR("pthread_create failed");
+		pthread_setname_np(workers[i].thread, "nlmon-scan");
+	}
+	scan_worker_main(&workers[0]);
+
+	for (i = 0; i < nr; i++) {
+		if (i)
+			pthread_join(workers[i].thread, NULL);
+		query_close(&workers[i].qs);
+		free(workers[i].tids);
+	}
+	free(workers);
+	free(scan_pids);
+	DEBUG("Initial threads found: %d  processes: %d  scan threads: %d\n",
+		atomic_read(&nr_threads), nr_scan_pids, nr);
+}
+
+/* tgid of every task seen by the resync scan, 0 if not seen */
+static int *resync_tgids;
+static int *resync_tids;
+static int nr_resync_tids, max_resync_tids;
+
+static void resync_seen(int tid, int tgid)
+{
+	if (tid <= 0 || tid >= pid_max)
+		return;
+	resync_tgids[tid] = tgid;
+	ids_add(tid, &resync_tids, &nr_resync_tids, &max_resync_tids);
+}
+
+static int task_alive(int tid)
+{
+	char name[30];
+
+	snprintf(name, sizeof(name), "/proc/%d", tid);
+	return !access(name, F_OK);
+}
+
+/*
+ * Reconciles the tracked tasks against /proc after events were lost, or
+ * against the cgroups in cgroup scoped mode. Only the seen and the tracked
+ * tasks are visited. Starting and exiting a task is atomic per tid, so a
+ * task that an event added or removed meanwhile is left alone.
+ */
+static void *resync_main(void *unused)
+{
+	int i, tid, gone, added = 0, removed = 0;
+
+	resync_tgids = calloc(pid_max, sizeof(int));
+	if (!resync_tgids)
+		DIE_PERROR("calloc failed");
+	nr_resync_tids = 0;
+	scan_procfs_tasks(resync_seen);
+
+	for (i = 0; i < nr_resync_tids; i++) {
+		tid = resync_tids[i];
+		if (task_tracked(tid))
+			continue;
+
+		if (task_alive(tid) && track_task(tid, resync_tgids[tid], cgroup_scoped()))
+			added++;
 	}
-	closedir(dir);
-	return count;
+
+	for_each_task(tid) {
+		if (resync_tgids[tid])
+			continue;
+
+		/* tasks that moved out of the selected cgroups are dropped */
+		gone = !task_alive(tid) || (cgroup_scoped() && !cgroup_member(tid));
+		if (!gone)
+			continue;
+
+		if (untrack_task(tid))
+			removed++;
+	}
+	free(resync_tgids);
+
+	/* the scan covered the tasks of the dropped events */
+	__atomic_store_n(&events_dropped, 0, __ATOMIC_RELEASE);
+
+	nr_resyncs++;
+	nr_resync_added += added;
+	nr_resync_removed += removed;
+	DEBUG("resync: added %d  removed %d  lost events so far: %lu\n",
+		added, removed, nr_lost_events);
+	__sync_lock_release(&resync_running);
+	return NULL;
+}
+
+/* picks up tasks that moved between cgroups */
+void proc_events_rescan(void)
+{
+	start_resync();
+}
+
+void proc_events_report(void)
+{
+	DEBUG("connector events: %lu  filtered: %lu  lost: %lu  overflows: %lu  resyncs: %lu  added: %lu  removed: %lu\n",
+		nr_events, nr_filtered_events, nr_lost_events, nr_overflows, nr_resyncs,
+		nr_resync_added, nr_resync_removed);
+	DEBUG("event ring: size: %u  depth: %u  high-water: %u  drops: %lu\n",
+		event_ring.size, ring_depth(&event_ring), event_ring.hwm, event_ring.drops);
+	table_report();
+	if (event_ring.drops)
+		fprintf(stderr, "event ring: %lu events dropped, high-water mark %u of %u\n",
+			event_ring.drops, event_ring.hwm, event_ring.size);
+	if (nr_lost_events || nr_overflows)
+		fprintf(stderr, "connector: %lu events delivered, %lu filtered, %lu lost, "
+			"%lu overflows, %lu resyncs added %lu and removed %lu tasks\n",
+			nr_events, nr_filtered_events, nr_lost_events,
+			nr_overflows, nr_resyncs, nr_resync_added, nr_resync_removed);
 }
 
 static void *scan_procfs(void *unused)
 {
-	struct dirent *dentry;
-	int len, threads;
-	DIR *dir;
-
-	dir = opendir("/proc");
-	if (!dir)
-		DIE_PERROR("opendir failed");
-
-	while ((dentry = readdir(dir)) != NULL) {
-                if (dentry->d_name[0] == '.')
-                        continue;
-                len = strlen(dentry->d_name);
-                if (!len)
-                        continue;
-                /* we're only interested in pid files */
-                if (!isdigit(dentry->d_name[0]))
-                        continue;
-		threads = scan_procfs_threads(atoi(dentry->d_name));
-		atomic_add(threads, &nr_threads);
-	}
-	DEBUG("Initial threads found: %d\n", atomic_read(&nr_threads));
-	closedir(dir);
+	scan_startup();
 	pthread_exit(NULL);
 }
 
+/*
+ * Event loop variant, subscribes to the connector and scans the existing
+ * tasks. The scan threads are gone before the loop starts. Returns the
+ * connector socket.
+ */
+int proc_events_open(void)
+{
+	int nl_fd;
+
+	nl_fd = setup_connector();
+	set_proc_ev_listen(nl_fd, true);
+	scan_startup();
+	return nl_fd;
+}
+
 void *proc_events_main(void *unused)
 {
 	int nl_fd, rc;
@@ -218,6 +853,6 @@ void *proc_events_main(void *unused)
 	handle_proc_ev(nl_fd);
 
 	set_proc_ev_listen(nl_fd, false);
-	bm_destroy();
+	table_destroy();
 	pthread_exit(NULL);
 }
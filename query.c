@@ -0,0 +1,507 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Pipelined taskstats query engine.
+ *
+ * Instead of a ping-pong per thread a window of requests is kept in flight.
+ * Every request is tagged with a sequence number that encodes the slot index
+ * so replies can be demultiplexed in any order. Requests are pre-built and
+ * sent batched with a single sendto().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#define COMP "nlmon"
+#include "helper.h"
+#include "nlattr.h"
+#include "query.h"
+
+/* Generic macros for dealing with netlink sockets */
+#define GENLMSG_DATA(glh)       ((void *)(NLMSG_DATA(glh) + GENL_HDRLEN))
+#define GENLMSG_PAYLOAD(glh)    (NLMSG_PAYLOAD(glh, 0) - GENL_HDRLEN)
+#define NLA_DATA(na)            ((void *)((char*)(na) + NLA_HDRLEN))
+
+/* all fields up to the I/O accounting are used */
+#define TASKSTATS_MIN_SIZE	offsetof(struct taskstats, read_syscalls)
+
+/* Maximum size of response requested or message sent */
+#define MAX_MSG_SIZE    1024
+
+struct msgtemplate {
+	struct nlmsghdr n;
+	struct genlmsghdr g;
+	char buf[MAX_MSG_SIZE];
+};
+
+/* taskstats family id, identical for all sockets */
+static int nl_id;
+
+static int send_cmd(int sd, __u16 nlmsg_type, __u32 nlmsg_pid,
+	     __u8 genl_cmd, __u16 nla_type,
+	     void *nla_data, int nla_len)
+{
+	struct nlattr *na;
+	struct sockaddr_nl nladdr;
+	int r, buflen;
+	char *buf;
+
+	struct msgtemplate msg;
+
+	msg.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	msg.n.nlmsg_type = nlmsg_type;
+	msg.n.nlmsg_flags = NLM_F_REQUEST;
+	msg.n.nlmsg_seq = 0;
+	msg.n.nlmsg_pid = nlmsg_pid;
+	msg.g.cmd = genl_cmd;
+	msg.g.version = 0x1;
+	na = (struct nlattr *) GENLMSG_DATA(&msg);
+	na->nla_type = nla_type;
+	na->nla_len = nla_len + 1 + NLA_HDRLEN;
+	memcpy(NLA_DATA(na), nla_data, nla_len);
+	msg.n.nlmsg_len += NLMSG_ALIGN(na->nla_len);
+
+	buf = (char *) &msg;
+	buflen = msg.n.nlmsg_len ;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	while ((r = sendto(sd, buf, buflen, 0, (struct sockaddr *) &nladdr,
+			   sizeof(nladdr))) < buflen) {
+		if (r > 0) {
+			buf += r;
+			buflen -= r;
+		} else if (errno != EAGAIN)
+			return -1;
+	}
+	return 0;
+}
+
+static int get_family_id(int sd, __u32 portid)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[256];
+	} ans;
+
+	char name[100];
+	int id = 0, rc;
+	struct nlattr *na;
+	int rep_len;
+
+	memset(name, 0, 100);
+	strcpy(name, TASKSTATS_GENL_NAME);
+	rc = send_cmd(sd, GENL_ID_CTRL, portid, CTRL_CMD_GETFAMILY,
+			CTRL_ATTR_FAMILY_NAME, (void *)name,
+			strlen(TASKSTATS_GENL_NAME)+1);
+	if (rc < 0)
+		return 0;	/* sendto() failure? */
+
+	rep_len = recv(sd, &ans, sizeof(ans), 0);
+	if (ans.n.nlmsg_type == NLMSG_ERROR ||
+	    (rep_len < 0) || !NLMSG_OK((&ans.n), rep_len))
+		return 0;
+
+	na = (struct nlattr *) GENLMSG_DATA(&ans);
+	na = (struct nlattr *) ((char *) na + NLA_ALIGN(na->nla_len));
+	if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+		id = *(__u16 *) NLA_DATA(na);
+	}
+	return id;
+}
+
+static int roundup_pow2(int n)
+{
+	int r = 1;
+
+	while (r < n)
+		r <<= 1;
+	return r;
+}
+
+void query_open(struct query_sock *qs, int window)
+{
+	int i, rc, rcvbufsz;
+	struct sockaddr_nl nla;
+	socklen_t len;
+
+	if (window < 1 || window > QUERY_WINDOW_MAX)
+		DIE("invalid query window: %d\n", window);
+
+	memset(qs, 0, sizeof(*qs));
+	qs->window = roundup_pow2(window);
+
+	qs->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (qs->fd < 0)
+		DIE_PERROR("netlink socket failed");
+
+	memset(&nla, 0, sizeof(nla));
+	nla.nl_family = AF_NETLINK;
+
+	rc = bind(qs->fd, (struct sockaddr *) &nla, sizeof(struct sockaddr_nl));
+	if (rc < 0)
+		DIE_PERROR("netlink bind failed");
+
+	/* the kernel assigned port id is used as nlmsg_pid for all requests */
+	len = sizeof(nla);
+	if (getsockname(qs->fd, (struct sockaddr *) &nla, &len) < 0)
+		DIE_PERROR("netlink getsockname failed");
+	qs->portid = nla.nl_pid;
+
+	/* the whole window of replies must fit into the receive buffer */
+	rcvbufsz = qs->window * QUERY_RX_SIZE;
+	if (setsockopt(qs->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbufsz, sizeof(rcvbufsz)) < 0)
+		setsockopt(qs->fd, SOL_SOCKET, SO_RCVBUF, &rcvbufsz, sizeof(rcvbufsz));
+
+	len = sizeof(int);
+	if (getsockopt(qs->fd, SOL_SOCKET, SO_RCVBUF, &rcvbufsz, &len) < 0)
+		fprintf(stderr, "Unable to get socket rcv buf size\n");
+	else
+		DEBUG("receive buffer size: %d\n", rcvbufsz);
+
+	if (!nl_id) {
+		nl_id = get_family_id(qs->fd, qs->portid);
+		if (!nl_id)
+			DIE_PERROR("Error getting family id");
+		DEBUG("family id %d\n", nl_id);
+	}
+
+	qs->slots = calloc(qs->window, sizeof(struct query_slot));
+	qs->free = calloc(qs->window, sizeof(int));
+	qs->batch = calloc(qs->window, sizeof(struct query_req));
+	if (!qs->slots || !qs->free || !qs->batch)
+		DIE_PERROR("calloc failed");
+
+	/* replies are parsed in place, keep them 8 byte aligned for the u64s */
+	if (posix_memalign((void **) &qs->rx_buf, 8, QUERY_RX_BATCH * QUERY_RX_SIZE))
+		DIE("allocating receive buffer failed\n");
+	for (i = 0; i < QUERY_RX_BATCH; i++) {
+		qs->rx_iov[i].iov_base = qs->rx_buf + i * QUERY_RX_SIZE;
+		qs->rx_msg[i].msg_hdr.msg_iov = &qs->rx_iov[i];
+		qs->rx_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < qs->window; i++) {
+		struct query_req *req = &qs->batch[i];
+
+		/* hand out low slots first */
+		qs->free[i] = qs->window - 1 - i;
+
+		req->n.nlmsg_len = sizeof(struct query_req);
+		req->n.nlmsg_type = nl_id;
+		req->n.nlmsg_flags = NLM_F_REQUEST;
+		req->n.nlmsg_pid = qs->portid;
+		req->g.cmd = TASKSTATS_CMD_GET;
+		req->g.version = 0x1;
+		req->na.nla_len = NLA_HDRLEN + sizeof(__u32);
+	}
+	qs->nr_free = qs->window;
+}
+
+void query_close(struct query_sock *qs)
+{
+	DEBUG("query socket %u: sent: %lu  received: %lu  reissued: %lu  lost: %lu  stale: %lu  overruns: %lu\n",
+		qs->portid, qs->sent, qs->received, qs->reissued,
+		qs->lost, qs->stale, qs->overruns);
+	DEBUG("query socket %u: receive calls: %lu  malformed: %lu\n",
+		qs->portid, qs->rx_calls, qs->malformed);
+	close(qs->fd);
+	free(qs->rx_buf);
+	free(qs->slots);
+	free(qs->free);
+	free(qs->batch);
+}
+
+/* seq encodes the slot index in the low bits, the slot generation above */
+static void slot_new_seq(struct query_sock *qs, struct query_slot *slot)
+{
+	int idx = slot - qs->slots;
+
+	do {
+		slot->gen++;
+		slot->seq = slot->gen * qs->window + idx;
+	} while (!slot->seq);
+}
+
+static struct query_slot *slot_lookup(struct query_sock *qs, __u32 seq)
+{
+	struct query_slot *slot = &qs->slots[seq & (qs->window - 1)];
+
+	if (!slot->busy || slot->seq != seq)
+		return NULL;
+	return slot;
+}
+
+static void slot_release(struct query_sock *qs, struct query_slot *slot)
+{
+	slot->busy = 0;
+	qs->free[qs->nr_free++] = slot - qs->slots;
+	qs->inflight--;
+}
+
+static void batch_add(struct query_sock *qs, struct query_slot *slot)
+{
+	struct query_req *req = &qs->batch[qs->nr_batched++];
+
+	req->n.nlmsg_seq = slot->seq;
+	req->na.nla_type = slot->type;
+	req->id = slot->id;
+}
+
+/* all batched requests are sent with one syscall */
+void query_flush(struct query_sock *qs)
+{
+	struct sockaddr_nl nladdr;
+	int rc;
+
+	if (!qs->nr_batched)
+		return;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+retry:
+	rc = sendto(qs->fd, qs->batch, qs->nr_batched * sizeof(struct query_req), 0,
+		    (struct sockaddr *) &nladdr, sizeof(nladdr));
+	if (rc < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			goto retry;
+		DIE_PERROR("sending taskstats requests failed");
+	}
+	qs->sent += qs->nr_batched;
+	qs->nr_batched = 0;
+}
+
+/* give every outstanding request a new sequence number and send it again */
+void query_reissue(struct query_sock *qs)
+{
+	struct query_slot *slot;
+	int i;
+
+	qs->nr_batched = 0;
+	for (i = 0; i < qs->window; i++) {
+		slot = &qs->slots[i];
+		if (!slot->busy)
+			continue;
+		if (++slot->retries > QUERY_MAX_RETRIES) {
+			DEBUG("query for %d lost\n", slot->id);
+			slot_release(qs, slot);
+			qs->lost++;
+			continue;
+		}
+		slot_new_seq(qs, slot);
+		batch_add(qs, slot);
+		qs->reissued++;
+	}
+	query_flush(qs);
+}
+
+/* returns the stats of one AGGR_PID / AGGR_TGID nest in place */
+static struct taskstats *parse_aggr(struct query_sock *qs, struct nlattr *aggr)
+{
+	struct nlattr *na;
+	int rem;
+
+	nla_for_each_nested(na, aggr, rem) {
+		if (na->nla_type != TASKSTATS_TYPE_STATS)
+			continue;
+		/* older kernels send a smaller struct */
+		if (nla_len(na) < TASKSTATS_MIN_SIZE) {
+			qs->malformed++;
+			return NULL;
+		}
+		return nla_data(na);
+	}
+	return NULL;
+}
+
+/* slot is NULL for exit records */
+static void parse_reply(struct query_sock *qs, struct nlmsghdr *nlh, struct query_slot *slot)
+{
+	struct taskstats *t = NULL, *group = NULL;
+	struct nlattr *na;
+	int rem;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+		qs->malformed++;
+		return;
+	}
+
+	nla_for_each_attr(na, GENLMSG_DATA(nlh), GENLMSG_PAYLOAD(nlh), rem) {
+		switch (na->nla_type) {
+		case TASKSTATS_TYPE_NULL:
+			break;
+		case TASKSTATS_TYPE_AGGR_PID:
+			t = parse_aggr(qs, na);
+			break;
+		case TASKSTATS_TYPE_AGGR_TGID:
+			/* exit records carry it if a multi-threaded process died */
+			group = parse_aggr(qs, na);
+			break;
+		default:
+			fprintf(stderr, "Unknown nla_type %d\n", na->nla_type);
+		}
+	}
+
+	if (!slot) {
+		if (t)
+			qs->async_handler(t, group, qs->priv);
+		return;
+	}
+	if (slot->type == TASKSTATS_CMD_ATTR_TGID)
+		t = group;
+	if (t)
+		qs->handler(t, slot->id, slot->type, qs->priv);
+}
+
+/* handle all netlink messages of one datagram */
+static void parse_datagram(struct query_sock *qs, struct nlmsghdr *nlh, int len)
+{
+	struct query_slot *slot;
+
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		/* exit records of the cpumask listener are not addressed to us */
+		if (nlh->nlmsg_pid != qs->portid) {
+			if (nlh->nlmsg_type != NLMSG_ERROR && qs->async_handler)
+				parse_reply(qs, nlh, NULL);
+			continue;
+		}
+
+		slot = slot_lookup(qs, nlh->nlmsg_seq);
+		if (!slot) {
+			/* reply to a request that was reissued already */
+			qs->stale++;
+			continue;
+		}
+
+		if (nlh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+			/* ESRCH: the task is gone already */
+			if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*err)))
+				qs->malformed++;
+			else if (qs->error_handler)
+				qs->error_handler(slot->id, slot->type, err->error, qs->priv);
+			else if (err->error != -ESRCH)
+				fprintf(stderr, "reply error for %d, errno %d\n", slot->id, err->error);
+		} else
+			parse_reply(qs, nlh, slot);
+
+		qs->received++;
+		slot_release(qs, slot);
+	}
+	if (len)
+		qs->malformed++;
+}
+
+/* returns the number of received datagrams, 0 if nothing was pending */
+static int query_recv(struct query_sock *qs, int flags)
+{
+	struct mmsghdr *mm;
+	int i, rc;
+
+	/* iovecs may have been shortened by the last call */
+	for (i = 0; i < QUERY_RX_BATCH; i++) {
+		qs->rx_msg[i].msg_hdr.msg_flags = 0;
+		qs->rx_iov[i].iov_len = QUERY_RX_SIZE;
+	}
+
+	rc = recvmmsg(qs->fd, qs->rx_msg, QUERY_RX_BATCH, flags, NULL);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		if (errno == ENOBUFS) {
+			/* replies were dropped, we cannot tell which */
+			qs->overruns++;
+			query_reissue(qs);
+			return 0;
+		}
+		DIE_PERROR("receiving taskstats replies failed");
+	}
+	qs->rx_calls++;
+
+	for (i = 0; i < rc; i++) {
+		mm = &qs->rx_msg[i];
+		if (mm->msg_hdr.msg_flags & MSG_TRUNC) {
+			fprintf(stderr, "truncated reply, len %u\n", mm->msg_len);
+			qs->malformed++;
+			continue;
+		}
+		parse_datagram(qs, mm->msg_hdr.msg_iov->iov_base, mm->msg_len);
+	}
+	return rc;
+}
+
+/* wait for at least one reply, then take everything that is pending */
+static void query_wait(struct query_sock *qs)
+{
+	struct pollfd pfd = { .fd = qs->fd, .events = POLLIN };
+	int rc;
+
+	query_flush(qs);
+
+	rc = poll(&pfd, 1, QUERY_TIMEOUT_MS);
+	if (rc < 0) {
+		if (errno == EINTR)
+			return;
+		DIE_PERROR("poll failed");
+	}
+	if (!rc) {
+		query_reissue(qs);
+		return;
+	}
+	/* a full batch means there may be more */
+	while (query_recv(qs, MSG_DONTWAIT) == QUERY_RX_BATCH)
+		;
+}
+
+void query_submit(struct query_sock *qs, int id, int type)
+{
+	struct query_slot *slot;
+
+	while (!qs->nr_free)
+		query_wait(qs);
+
+	slot = &qs->slots[qs->free[--qs->nr_free]];
+	slot->busy = 1;
+	slot->id = id;
+	slot->type = type;
+	slot->retries = 0;
+	slot_new_seq(qs, slot);
+	qs->inflight++;
+
+	batch_add(qs, slot);
+	/* keep the pipe filled without waiting for the whole window */
+	if (qs->nr_batched >= qs->window / 4)
+		query_flush(qs);
+}
+
+/* take all pending replies and exit records without blocking */
+void query_recv_async(struct query_sock *qs)
+{
+	while (query_recv(qs, MSG_DONTWAIT) == QUERY_RX_BATCH)
+		;
+}
+
+/* wait until all requests are answered or lost */
+void query_drain(struct query_sock *qs)
+{
+	while (qs->inflight)
+		query_wait(qs);
+}
+
+int query_register_cpumask(struct query_sock *qs, char *mask, int enable)
+{
+	int type = enable ? TASKSTATS_CMD_ATTR_REGISTER_CPUMASK
+			  : TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK;
+
+	return send_cmd(qs->fd, nl_id, qs->portid, TASKSTATS_CMD_GET,
+			type, mask, strlen(mask) + 1);
+}
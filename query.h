@@ -0,0 +1,90 @@
+#ifndef _QUERY_H
+#define _QUERY_H
+
+/*
+ * Pipelined taskstats query engine interface
+ */
+
+#include <sys/socket.h>
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+
+/* number of requests in flight per socket, rounded up to a power of two */
+#define QUERY_WINDOW_DEFAULT	64
+#define QUERY_WINDOW_MAX	4096
+
+/* outstanding requests are reissued if no reply arrives in time */
+#define QUERY_TIMEOUT_MS	100
+#define QUERY_MAX_RETRIES	3
+
+/* replies taken per recvmmsg() call and the room for each one */
+#define QUERY_RX_BATCH		32
+#define QUERY_RX_SIZE		2048
+
+/* pre-built TASKSTATS_CMD_GET request, only seq, type and id get patched */
+struct query_req {
+	struct nlmsghdr n;
+	struct genlmsghdr g;
+	struct nlattr na;
+	__u32 id;
+};
+
+struct query_slot {
+	__u32 seq;		/* sequence number of the request in flight */
+	__u32 gen;		/* bumped on every reuse to detect stale replies */
+	int id;			/* tid or tgid */
+	int type;		/* TASKSTATS_CMD_ATTR_PID or TASKSTATS_CMD_ATTR_TGID */
+	int retries;
+	int busy;
+};
+
+struct query_sock {
+	int fd;
+	__u32 portid;		/* netlink port id, replaces getpid() */
+	int window;
+	int inflight;
+
+	struct query_slot *slots;
+	int *free;		/* stack of free slot indices */
+	int nr_free;
+
+	struct query_req *batch;	/* requests not yet sent */
+	int nr_batched;
+
+	/* replies are received in batches and handed out without copying */
+	char *rx_buf;
+	struct mmsghdr rx_msg[QUERY_RX_BATCH];
+	struct iovec rx_iov[QUERY_RX_BATCH];
+
+	/* reply for a request */
+	void (*handler)(struct taskstats *t, int id, int type, void *priv);
+	/* exit records of the registered cpumask, group is set if the process died */
+	void (*async_handler)(struct taskstats *t, struct taskstats *group, void *priv);
+	/* optional, error replies are only reported to stderr otherwise */
+	void (*error_handler)(int id, int type, int error, void *priv);
+	void *priv;
+
+	/* statistics */
+	unsigned long sent;
+	unsigned long received;
+	unsigned long reissued;
+	unsigned long lost;
+	unsigned long stale;
+	unsigned long overruns;
+	unsigned long rx_calls;
+	unsigned long malformed;
+};
+
+/* query interface prototypes */
+void query_open(struct query_sock *qs, int window);
+void query_close(struct query_sock *qs);
+void query_submit(struct query_sock *qs, int id, int type);
+void query_drain(struct query_sock *qs);
+void query_recv_async(struct query_sock *qs);
+void query_flush(struct query_sock *qs);
+void query_reissue(struct query_sock *qs);
+int query_register_cpumask(struct query_sock *qs, char *mask, int enable);
+
+#endif
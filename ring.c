@@ -0,0 +1,77 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Lock-free single producer single consumer ring.
+ *
+ * The producer only writes the head and the consumer only writes the tail,
+ * both indices run freely and are masked on access. A record is published
+ * with a release store of the head and handed back with a release store of
+ * the tail, so neither side ever takes a lock.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "helper.h"
+#include "ring.h"
+
+void ring_alloc(struct ring *r, unsigned int size, unsigned int rec_size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	memset(r, 0, sizeof(*r));
+	r->buf = calloc(n, rec_size);
+	if (!r->buf)
+		DIE_PERROR("calloc failed");
+	r->size = n;
+	r->rec_size = rec_size;
+}
+
+void ring_free(struct ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/* producer side, returns -1 and counts a drop if the ring is full */
+int ring_push(struct ring *r, const void *rec)
+{
+	unsigned int head = r->head;
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == r->size) {
+		r->drops++;
+		return -1;
+	}
+	memcpy(r->buf + (head & (r->size - 1)) * r->rec_size, rec, r->rec_size);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	if (head + 1 - tail > r->hwm)
+		r->hwm = head + 1 - tail;
+	return 0;
+}
+
+/* consumer side, returns -1 if the ring is empty */
+int ring_pop(struct ring *r, void *rec)
+{
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head)
+		return -1;
+	memcpy(rec, r->buf + (tail & (r->size - 1)) * r->rec_size, r->rec_size);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* fill level, only a snapshot if the other side is running */
+unsigned int ring_depth(struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,31 @@
+#ifndef _RING_H
+#define _RING_H
+
+/*
+ * Lock-free single producer single consumer ring of fixed size records
+ */
+
+#define RING_CACHELINE	64
+
+struct ring {
+	char *buf;
+	unsigned int size;		/* number of records, power of two */
+	unsigned int rec_size;
+
+	/* only written by the producer */
+	unsigned int head __attribute__ ((aligned(RING_CACHELINE)));
+	unsigned int hwm;		/* highest fill level seen */
+	unsigned long drops;		/* records lost because the ring was full */
+
+	/* only written by the consumer */
+	unsigned int tail __attribute__ ((aligned(RING_CACHELINE)));
+};
+
+/* ring interface prototypes */
+void ring_alloc(struct ring *r, unsigned int size, unsigned int rec_size);
+void ring_free(struct ring *r);
+int ring_push(struct ring *r, const void *rec);
+int ring_pop(struct ring *r, void *rec);
+unsigned int ring_depth(struct ring *r);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * Copyright Penguin Boost, 2016
+ * Author(s): Jan Glauber <jan.glauber@gmail.com>
+ *
+ * Task table indexed directly by tid.
+ *
+ * Every possible tid owns a slot holding the tgid, the baselines and the
+ * cached name, a second table holds the per-process entries indexed by tgid.
+ * Both are reserved with pid_max slots but only the pages that are touched
+ * get committed, so the memory follows the used pid ranges and lookups need
+ * no search. The live bit of a slot is kept in the bitmap which the sweep
+ * walks with the set-bit iterator.
+ *
+ * A slot outlives its task until the exit record was accounted, the entry
+ * is in use as long as its tid is set.
+ *
+ * Slots are guarded by striped locks chosen by the tid, a process entry by
+ * the stripe of its tgid. A caller never holds two stripes at once, so the
+ * sweep, the exit records and the connector events only serialize if they
+ * touch tids of the same stripe. Slots are never unmapped, a pointer handed
+ * out under the stripe lock stays valid while the lock is held.
+ *
+ * The slots are grouped into page aligned slabs. A slab that stayed empty
+ * for a while is handed back to the kernel with MADV_DONTNEED and reads as
+ * free slots again, so the memory follows the live pid ranges after a burst
+ * of tasks instead of the largest number of tasks ever seen.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "table.h"
+#include "helper.h"
+
+#define NR_STRIPES	64
+#define STRIPE_CACHELINE	64
+
+struct stripe {
+	pthread_mutex_t lock;
+	/* exited tasks and processes of the stripe waiting for their exit record */
+	struct list_head exit_list;
+	struct list_head proc_exit_list;
+	/* protected by the lock, so no shared counter is bounced around */
+	unsigned long acquired;
+	unsigned long contended;
+} __attribute__ ((aligned(STRIPE_CACHELINE)));
+
+static struct stripe stripes[NR_STRIPES];
+
+/* at least that many slots per slab, keeps the slab walk short */
+#define SLAB_MIN_SLOTS		256
+
+/* cycles a slab must stay empty before its pages are released */
+#define SLAB_IDLE_CYCLES	16
+
+/* slots in use of a slab while its pages are being released */
+#define SLAB_RELEASING		-1
+
+/* idle cycles of a slab that holds no pages */
+#define SLAB_RELEASED		-1
+
+struct table {
+	struct task_entry *slots;
+	int *slab_used;			/* slots in use per slab */
+	int *slab_idle;			/* cycles the slab was empty */
+	int committed;			/* slabs that hold pages */
+	unsigned long released;		/* slabs handed back so far */
+};
+
+/* thread entries indexed by tid */
+static struct table threads;
+
+/* per-process entries indexed by tgid */
+static struct table procs;
+
+static int nr_slots;
+static int slab_slots;
+static int nr_slabs;
+
+/* untouched pages read as zero, slots are free until written */
+static void map_table(struct table *t)
+{
+	int i;
+
+	t->slots = mmap(NULL, nr_slabs * slab_slots * sizeof(struct task_entry),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (t->slots == MAP_FAILED)
+		DIE_PERROR("mmap failed");
+
+	t->slab_used = calloc(nr_slabs, sizeof(int));
+	t->slab_idle = malloc(nr_slabs * sizeof(int));
+	if (!t->slab_used || !t->slab_idle)
+		DIE_PERROR("allocating slabs failed");
+	for (i = 0; i < nr_slabs; i++)
+		t->slab_idle[i] = SLAB_RELEASED;
+}
+
+static void unmap_table(struct table *t)
+{
+	munmap(t->slots, nr_slabs * slab_slots * sizeof(struct task_entry));
+	free(t->slab_used);
+	free(t->slab_idle);
+}
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int r = a % b;
+
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+void table_alloc(int slots)
+{
+	int i, page = sysconf(_SC_PAGESIZE);
+
+	for (i = 0; i < NR_STRIPES; i++) {
+		pthread_mutex_init(&stripes[i].lock, NULL);
+		list_init(&stripes[i].exit_list);
+		list_init(&stripes[i].proc_exit_list);
+	}
+
+	/* the smallest number of slots that fills whole pages */
+	slab_slots = page / gcd(sizeof(struct task_entry), page);
+	while (slab_slots < SLAB_MIN_SLOTS)
+		slab_slots *= 2;
+	nr_slabs = (slots + slab_slots - 1) / slab_slots;
+	nr_slots = slots;
+
+	map_table(&threads);
+	map_table(&procs);
+	bm_alloc(slots);
+	DEBUG("task table: %d slabs of %d slots, %zu bytes each\n",
+		nr_slabs, slab_slots, slab_slots * sizeof(struct task_entry));
+}
+
+void table_destroy(void)
+{
+	unmap_table(&threads);
+	unmap_table(&procs);
+	bm_destroy();
+}
+
+static inline struct stripe *stripe_of(int tid)
+{
+	return &stripes[tid & (NR_STRIPES - 1)];
+}
+
+/* counts the acquisitions that had to wait for another thread */
+static struct stripe *lock_stripe(int tid)
+{
+	struct stripe *s = stripe_of(tid);
+
+	if (pthread_mutex_trylock(&s->lock)) {
+		pthread_mutex_lock(&s->lock);
+		s->contended++;
+	}
+	s->acquired++;
+	return s;
+}
+
+static void unlock_stripe(struct stripe *s)
+{
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* returns NULL if the slot is not in use, caller holds the stripe */
+static struct task_entry *lookup(struct table *t, int tid)
+{
+	if (tid <= 0 || tid >= nr_slots || t->slots[tid].tid != tid)
+		return NULL;
+	return &t->slots[tid];
+}
+
+/* waits while the pages of the slab are released, that is rare and short */
+static void slab_get(struct table *t, int slab)
+{
+	int used = __atomic_load_n(&t->slab_used[slab], __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		if (used == SLAB_RELEASING) {
+			sched_yield();
+			used = __atomic_load_n(&t->slab_used[slab], __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&t->slab_used[slab], &used, used + 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+	__atomic_store_n(&t->slab_idle[slab], 0, __ATOMIC_RELAXED);
+}
+
+static void slab_put(struct table *t, int slab)
+{
+	__atomic_fetch_sub(&t->slab_used[slab], 1, __ATOMIC_RELEASE);
+}
+
+/* caller holds the stripe, the slot must be free */
+static struct task_entry *init_slot(struct table *t, int tid, int tgid)
+{
+	struct task_entry *h = &t->slots[tid];
+
+	slab_get(t, tid / slab_slots);
+	memset(h, 0, sizeof(struct task_entry));
+	h->tid = tid;
+	h->tgid = tgid;
+	list_init(&h->exit_list);
+	return h;
+}
+
+static void free_slot(struct table *t, struct task_entry *h)
+{
+	list_del_init(&h->exit_list);
+	h->tid = 0;
+	slab_put(t, (h - t->slots) / slab_slots);
+}
+
+/*
+ * Releases the pages of slabs that were empty for SLAB_IDLE_CYCLES, a slab
+ * can not be taken while it is marked as releasing. Called once per cycle.
+ */
+static void shrink_table(struct table *t)
+{
+	size_t size = slab_slots * sizeof(struct task_entry);
+	int i, used;
+
+	t->committed = 0;
+	for (i = 0; i < nr_slabs; i++) {
+		if (t->slab_idle[i] == SLAB_RELEASED)
+			continue;
+		t->committed++;
+		if (__atomic_load_n(&t->slab_used[i], __ATOMIC_ACQUIRE)) {
+			t->slab_idle[i] = 0;
+			continue;
+		}
+		if (++t->slab_idle[i] < SLAB_IDLE_CYCLES)
+			continue;
+
+		used = 0;
+		if (!__atomic_compare_exchange_n(&t->slab_used[i], &used, SLAB_RELEASING, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+		if (madvise((char *) t->slots + i * size, size, MADV_DONTNEED) < 0)
+			DIE_PERROR("madvise failed");
+		t->slab_idle[i] = SLAB_RELEASED;
+		__atomic_store_n(&t->slab_used[i], 0, __ATOMIC_RELEASE);
+		t->committed--;
+		t->released++;
+	}
+}
+
+/* a new thread of the process, process entries are created on demand */
+static void proc_get_thread(int tgid)
+{
+	struct stripe *s = lock_stripe(tgid);
+	struct task_entry *p = lookup(&procs, tgid);
+
+	/* a tgid that was reused before the old process was reaped starts over */
+	if (p && list_is_empty(&p->exit_list)) {
+		p->nr_threads++;
+		goto out;
+	}
+	if (p)
+		free_slot(&procs, p);
+	p = init_slot(&procs, tgid, tgid);
+	p->nr_threads = 1;
+	p->queried_cycle = -1;
+out:
+	unlock_stripe(s);
+}
+
+/* the process entry is kept until its exit record was accounted */
+static void proc_put_thread(int tgid, int cycle)
+{
+	struct stripe *s = lock_stripe(tgid);
+	struct task_entry *p = lookup(&procs, tgid);
+
+	/* a thread removed after its exit event must not queue the process twice */
+	if (p && --p->nr_threads <= 0 && list_is_empty(&p->exit_list)) {
+		p->exit_cycle = cycle;
+		list_add_tail(&p->exit_list, &s->proc_exit_list);
+	}
+	unlock_stripe(s);
+}
+
+/* lock-free, the task may start or exit right after the check */
+int task_tracked(int tid)
+{
+	if (tid <= 0 || tid >= nr_slots)
+		return 0;
+	return bm_test(tid);
+}
+
+/*
+ * Marks the task live and sets up its slot. With moved_in the first reply
+ * only sets the baseline. Returns 0 if the task was live already or is out
+ * of range.
+ */
+int task_start(int tid, int tgid, int moved_in)
+{
+	struct task_entry *h;
+	struct stripe *s;
+
+	/* pid_max may have been raised after the table was sized */
+	if (tid <= 0 || tid >= nr_slots) {
+		DEBUG("tid %d out of range, not tracked\n", tid);
+		return 0;
+	}
+
+	s = lock_stripe(tid);
+	if (bm_test(tid)) {
+		unlock_stripe(s);
+		return 0;
+	}
+	bm_set(tid);
+
+	/* tid was reused before the old task was reaped */
+	h = lookup(&threads, tid);
+	if (h)
+		free_slot(&threads, h);
+	h = init_slot(&threads, tid, tgid);
+	h->moved_in = moved_in;
+	unlock_stripe(s);
+
+	proc_get_thread(tgid);
+	return 1;
+}
+
+/*
+ * The task is no longer live, the slot keeps the baseline until the exit
+ * record was accounted. Returns 0 if the task was not live.
+ */
+int task_exit(int tid, int cycle)
+{
+	struct task_entry *h;
+	struct stripe *s;
+	int tgid = 0;
+
+	if (!task_tracked(tid))
+		return 0;
+
+	s = lock_stripe(tid);
+	if (!bm_test(tid)) {
+		unlock_stripe(s);
+		return 0;
+	}
+	bm_clear(tid);
+
+	h = lookup(&threads, tid);
+	if (h && list_is_empty(&h->exit_list)) {
+		h->exit_cycle = cycle;
+		list_add_tail(&h->exit_list, &s->exit_list);
+		tgid = h->tgid;
+	}
+	unlock_stripe(s);
+
+	if (tgid)
+		proc_put_thread(tgid, cycle);
+	return 1;
+}
+
+/* ignores already-gone, a live task stays live until its exit event */
+void remove_task_entry(int tid)
+{
+	struct task_entry *old;
+	struct stripe *s;
+	int tgid = 0;
+
+	s = lock_stripe(tid);
+	old = lookup(&threads, tid);
+	if (!old) {
+		unlock_stripe(s);
+		DEBUG("duplicated del for tid %d\n", tid);
+		return;
+	}
+	if (list_is_empty(&old->exit_list))
+		tgid = old->tgid;
+	free_slot(&threads, old);
+	unlock_stripe(s);
+
+	if (tgid)
+		proc_put_thread(tgid, 0);
+}
+
+static int reap_list(struct table *t, struct list_head *list, int cycle)
+{
+	struct list_head *pos, *n;
+	struct task_entry *h;
+	int reaped = 0;
+
+	list_for_each_safe(pos, n, list) {
+		h = list_entry(pos, struct task_entry, exit_list);
+		if (h->exit_cycle >= cycle - 1)
+			continue;
+		free_slot(t, h);
+		reaped++;
+	}
+	return reaped;
+}
+
+/*
+ * Remove exited tasks that got no exit record within one cycle and release
+ * the slabs that stayed empty.
+ */
+int reap_task_entries(int cycle)
+{
+	int i, reaped = 0;
+	struct stripe *s;
+
+	for (i = 0; i < NR_STRIPES; i++) {
+		s = lock_stripe(i);
+		reaped += reap_list(&threads, &s->exit_list, cycle);
+		reap_list(&procs, &s->proc_exit_list, cycle);
+		unlock_stripe(s);
+	}
+	shrink_table(&threads);
+	shrink_table(&procs);
+	return reaped;
+}
+
+/* accquires the stripe of the tgid, release with put_task_entry(tgid) */
+struct task_entry *get_proc_entry(int tgid)
+{
+	struct stripe *s = lock_stripe(tgid);
+	struct task_entry *p;
+
+	p = lookup(&procs, tgid);
+	if (!p)
+		unlock_stripe(s);
+	return p;
+}
+
+/* ignores already-gone */
+void remove_proc_entry(int tgid)
+{
+	struct stripe *s = lock_stripe(tgid);
+	struct task_entry *old;
+
+	old = lookup(&procs, tgid);
+	if (old)
+		free_slot(&procs, old);
+	unlock_stripe(s);
+}
+
+/* accquires the stripe of the tid */
+struct task_entry *get_task_entry(int tid)
+{
+	struct stripe *s = lock_stripe(tid);
+	struct task_entry *h;
+
+	h = lookup(&threads, tid);
+	if (!h)
+		unlock_stripe(s);
+	return h;
+}
+
+/* releases the stripe of the tid or tgid the entry was taken with */
+void put_task_entry(int tid)
+{
+	unlock_stripe(stripe_of(tid));
+}
+
+/* lock acquisitions that had to wait, a snapshot while others are running */
+void table_contention(unsigned long *acquired, unsigned long *contended)
+{
+	int i;
+
+	*acquired = 0;
+	*contended = 0;
+	for (i = 0; i < NR_STRIPES; i++) {
+		*acquired += __atomic_load_n(&stripes[i].acquired, __ATOMIC_RELAXED);
+		*contended += __atomic_load_n(&stripes[i].contended, __ATOMIC_RELAXED);
+	}
+}
+
+/* memory held by the slabs as of the last cycle */
+void table_report(void)
+{
+	size_t size = slab_slots * sizeof(struct task_entry) / 1024;
+	unsigned long acquired, contended;
+
+	table_contention(&acquired, &contended);
+	DEBUG("task table: slabs held: %d + %d of %d (%zu kB)  released: %lu + %lu\n",
+		threads.committed, procs.committed, 2 * nr_slabs,
+		(threads.committed + procs.committed) * size,
+		threads.released, procs.released);
+	DEBUG("task table: locks taken: %lu  contended: %lu\n", acquired, contended);
+}
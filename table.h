@@ -0,0 +1,59 @@
+#ifndef _TABLE_H
+#define _TABLE_H
+
+#include <linux/taskstats.h>
+
+#include "list.h"
+#include "bitmap.h"
+
+/*
+ * Task table indexed directly by tid, see table.c
+ */
+
+/* also used for per-process entries where tid and tgid are the tgid */
+struct task_entry {
+	int tid;			/* slot in use if set */
+	int tgid;
+	/* exited tasks wait here for their exit record */
+	struct list_head exit_list;
+	int exit_cycle;
+	/* data */
+	unsigned long long utime;	// carefull here with 64 bits... or need a lock
+	unsigned long long stime;
+	unsigned long long cpu_delay;
+	unsigned long long rss;
+	unsigned long long io_rd_bytes;
+	unsigned long long io_wr_bytes;
+	unsigned long long blkio_delay;
+	int idle;			/* consecutive queries without activity */
+	unsigned int btime;		/* start time of the task, detects tid reuse */
+	int moved_in;			/* the first reply only sets the baseline */
+	/* process entries only */
+	int nr_threads;
+	int collapsed;			/* queried per tgid */
+	int queried_cycle;
+	int have_baseline;
+	/* cached name, kept up to date by comm events, empty if unknown */
+	char comm[TS_COMM_LEN];
+};
+
+/* live tasks in ascending tid order, -1 after the last one */
+#define task_next(tid)		bm_next(tid)
+#define for_each_task(tid)	bm_for_each(tid)
+
+/* task table interface prototypes */
+void table_alloc(int slots);
+void table_destroy(void);
+int task_tracked(int tid);
+int task_start(int tid, int tgid, int moved_in);
+int task_exit(int tid, int cycle);
+struct task_entry *get_task_entry(int tid);
+void put_task_entry(int tid);
+void remove_task_entry(int tid);
+int reap_task_entries(int cycle);
+struct task_entry *get_proc_entry(int tgid);
+void remove_proc_entry(int tgid);
+void table_contention(unsigned long *acquired, unsigned long *contended);
+void table_report(void);
+
+#endif